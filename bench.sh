@@ -0,0 +1,18 @@
+# Compare the dispatch variants on Blargg's cpu_instrs roms
+# usage: ./bench.sh [rom dir] (defaults to cpu_instrs/individual)
+ROMS=${1:-cpu_instrs/individual}
+VARIANTS="gb gb-threaded gb-eager"
+
+make $VARIANTS > /dev/null || exit 1
+
+for rom in "$ROMS"/*.gb; do
+    for v in $VARIANTS; do
+        # keep the best of three runs to smooth out scheduler noise
+        best=0
+        for i in 1 2 3; do
+            ips=$(./$v --headless "$rom" | awk '/instr\/s/ { print $5 }')
+            best=$(echo "$ips $best" | awk '{ print ($1 > $2) ? $1 : $2 }')
+        done
+        printf "%-40s %-14s %12.0f instr/s\n" "$(basename "$rom")" "$v" "$best"
+    done
+done | tee bench_output.txt
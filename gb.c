@@ -1,30 +1,24 @@
+#define _DEFAULT_SOURCE
 #include "gb.h"
 #include "bootrom.h"
-#include <SDL.h>
-#include <ncurses.h>
+#include "opcodes.h"
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <fcntl.h>
+#if defined(__SSE2__) && !defined(GB_NO_SIMD)
+#include <immintrin.h>
+#endif
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
 
-SDL_Window* window = NULL;
-SDL_Renderer* renderer = NULL;
-
-typedef struct {
-    u8 num;
-    u8 prefix;
-    char name[64];
-    u8 bytes;
-    u8 cycles;
-    char flZ[64];
-    char flN[64];
-    char flH[64];
-    char flC[64];
-} opcode;
-opcode opcs[512];
-
 void initialize(gb* g) {
+    memset(g, 0, sizeof(*g));
+    g->next_event = ~0ull;
+    memset(g->tile_dirty, 1, sizeof(g->tile_dirty));
+    flags_load(g);
     // Initialize values to after bootrom for testing...
     /*_A = 0x01;*/
     /*F = 0xB0;*/
@@ -38,118 +32,721 @@ void initialize(gb* g) {
     /*PC = 0x0100;*/
 }
 
-void init_SDL() {
-    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
-        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
-        exit(1);
+// cartridge header byte 0x147 -> mapper
+int cart_init(gb* g) {
+    u8 type = g->rom[0x147];
+    if (type == 0x00 || type == 0x08 || type == 0x09) g->mbc = MBC_NONE;
+    else if (type >= 0x01 && type <= 0x03) g->mbc = MBC_1;
+    else if (type >= 0x0F && type <= 0x13) g->mbc = MBC_3;
+    else if (type >= 0x19 && type <= 0x1E) g->mbc = MBC_5;
+    else return ROM_ERR_CART;
+    g->has_rtc = (type == 0x0F || type == 0x10);
+
+    // header byte 0x149 -> external ram size
+    static const u32 ram_sizes[] = {0, 0x800, 0x2000, 0x8000, 0x20000, 0x10000};
+    u8 ram = g->rom[0x149];
+    g->eram_size = ram < 6 ? ram_sizes[ram] : 0;
+    // carts without a mapper keep 0xa000-0xbfff as plain ram
+    if (g->mbc == MBC_NONE) g->eram_size = 0x2000;
+
+    g->rom_bank = 1;
+    g->ram_bank = 0;
+    g->ram_enable = g->mbc == MBC_NONE;
+    return ROM_OK;
+}
+
+// debugger breakpoints and write watchpoints, one bit per address. pages
+// holding a watchpoint are write protected in the memory map so only their
+// writes reach io_write, nothing else pays for them
+typedef struct debug {
+    u8 brk[0x2000];
+    u8 watch[0x2000];
+    u8 watch_pages[0x100]; // watchpoints per page
+    u16 breaks;
+    u16 watches;
+} debug;
+
+int bit_test(const u8* bits, u16 a) { return bits[a >> 3] >> (a & 7) & 1; }
+
+int page_watched(gb* g, u8 page) {
+    return g->debug && g->debug->watch_pages[page];
+}
+
+void watch_map(gb* g) {
+    for (int p = 0; p < 0x100; p++)
+        if (page_watched(g, p)) g->wmap[p] = NULL;
+}
+
+// the eram bank mapped at 0xa000, NULL if the ram is disabled, missing or
+// the mbc3 clock is selected
+u8* eram_bank(gb* g) {
+    if (!g->ram_enable || !g->eram_size) return NULL;
+    if (g->mbc == MBC_3 && g->ram_bank >= 8) return NULL;
+    u32 banks = g->eram_size < 0x2000 ? 1 : g->eram_size / 0x2000;
+    u8 bank = g->ram_bank;
+    if (g->mbc == MBC_1) bank = g->mbc1_mode ? g->bank_hi : 0;
+    return &g->eram[(bank % banks) * 0x2000];
+}
+
+// points the rom and external ram pages at the selected banks
+void map_banks(gb* g) {
+    u32 bank0 = 0, bank1 = g->rom_bank;
+    if (g->mbc == MBC_1) {
+        bank1 = g->bank_hi << 5 | g->rom_bank;
+        if (g->mbc1_mode) bank0 = g->bank_hi << 5;
+    }
+    bank0 = (bank0 % g->rom_banks) * 0x4000;
+    bank1 = (bank1 % g->rom_banks) * 0x4000;
+    for (int p = 0x00; p < 0x40; p++) g->rmap[p] = &g->rom[bank0 + (p << 8)];
+    for (int p = 0x40; p < 0x80; p++)
+        g->rmap[p] = &g->rom[bank1 + ((p - 0x40) << 8)];
+    if (!REG_BOOTROM) g->rmap[0x00] = bootrom;
+    g->block_break = 1;
+
+    // disabled ram, missing ram and the mbc3 clock go through io_read/write
+    u8* ram = eram_bank(g);
+    for (int p = 0xA0; p < 0xC0; p++)
+        g->rmap[p] = g->wmap[p] = ram ? &ram[(p - 0xA0) << 8] : NULL;
+    if (g->debug && g->debug->watches) watch_map(g);
+}
+
+// mbc3 clock. it counts emulated rather than host time so runs stay
+// reproducible
+void rtc_sync(gb* g) {
+    u64 secs = (g->cpu_ticks - g->rtc_ticks) / CPU_FREQ;
+    g->rtc_ticks += secs * CPU_FREQ;
+    if (!secs || (g->rtc[4] & 0x40)) return; // halted
+
+    u64 day = (g->rtc[4] & 1) << 8 | g->rtc[3];
+    u64 t = g->rtc[0] + g->rtc[1] * 60 + g->rtc[2] * 3600 + day * 86400 + secs;
+    g->rtc[0] = t % 60;
+    g->rtc[1] = t / 60 % 60;
+    g->rtc[2] = t / 3600 % 24;
+    day = t / 86400;
+    if (day > 511) g->rtc[4] |= 0x80; // day counter carry
+    day %= 512;
+    g->rtc[3] = day & 0xFF;
+    g->rtc[4] = (g->rtc[4] & 0xFE) | (day >> 8);
+}
+
+// writes into 0x0000-0x7fff land in the mapper registers
+void mbc_write(gb* g, u16 a, u8 v) {
+    switch (g->mbc) {
+    case MBC_1:
+        if (a < 0x2000) g->ram_enable = (v & 0x0F) == 0x0A;
+        else if (a < 0x4000) g->rom_bank = (v & 0x1F) ? (v & 0x1F) : 1;
+        else if (a < 0x6000) g->bank_hi = v & 0x03;
+        else g->mbc1_mode = v & 0x01;
+        break;
+    case MBC_3:
+        if (a < 0x2000) g->ram_enable = (v & 0x0F) == 0x0A;
+        else if (a < 0x4000) g->rom_bank = (v & 0x7F) ? (v & 0x7F) : 1;
+        else if (a < 0x6000) g->ram_bank = v & 0x0F;
+        else {
+            // writing 0 then 1 latches the clock
+            if (g->rtc_latch == 0 && v == 1 && g->has_rtc) {
+                rtc_sync(g);
+                memcpy(g->rtc_latched, g->rtc, sizeof(g->rtc));
+            }
+            g->rtc_latch = v;
+        }
+        break;
+    case MBC_5:
+        if (a < 0x2000) g->ram_enable = (v & 0x0F) == 0x0A;
+        else if (a < 0x3000) g->rom_bank = (g->rom_bank & 0x100) | v;
+        else if (a < 0x4000) g->rom_bank = (v & 1) << 8 | (g->rom_bank & 0xFF);
+        else if (a < 0x6000) g->ram_bank = v & 0x0F;
+        break;
+    default: return;
     }
+    map_banks(g);
+}
 
-    window = SDL_CreateWindow("SmallBoy GB Emulator", SDL_WINDOWPOS_UNDEFINED,
-                              SDL_WINDOWPOS_UNDEFINED, DISPLAY_WIDTH * 4,
-                              DISPLAY_HEIGHT * 4, // Scaling up the window size
-                              SDL_WINDOW_SHOWN);
-    if (window == NULL) {
-        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
-        exit(1);
+void unload_rom(gb* g) {
+    if (!g->batched) { // otherwise gb_batch_free() frees them
+        if (g->rom_mapped) munmap((void*)g->rom, g->rom_size);
+        else free((void*)g->rom);
+        free(g->blocks);
+        jit_free(g);
+    }
+    g->rom = NULL;
+    g->blocks = NULL;
+    g->jit = NULL;
+    free(g->debug);
+    g->debug = NULL;
+}
+
+// maps the rom image read-only. banks are switched by repointing pages of the
+// memory map, so the image is never copied or written to. images that are
+// not a whole number of 16KB banks get a zero padded private copy instead,
+// reading past the end of a mapping would fault
+int load_rom(gb* g, const char* filename) {
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0) {
+        if (fd >= 0) close(fd);
+        return ROM_ERR_OPEN;
     }
 
-    renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
-    if (renderer == NULL) {
-        printf("Renderer could not be created! SDL_Error: %s\n",
-               SDL_GetError());
-        exit(1);
+    size_t size = st.st_size;
+    if (size >= 0x8000 && size % 0x4000 == 0) {
+        void* m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (m == MAP_FAILED) {
+            close(fd);
+            return ROM_ERR_READ;
+        }
+        g->rom = m;
+        g->rom_mapped = 1;
+    } else {
+        size_t padded = size < 0x8000 ? 0x8000 : (size + 0x3fff) & ~0x3fff;
+        u8* buf = calloc(padded, 1);
+        if (!buf || read(fd, buf, size) != (ssize_t)size) {
+            free(buf);
+            close(fd);
+            return ROM_ERR_READ;
+        }
+        g->rom = buf;
+        size = padded;
     }
+    close(fd);
+    g->rom_size = size;
+    g->rom_banks = size / 0x4000;
+
+    int status = cart_init(g);
+    if (status != ROM_OK) unload_rom(g);
+    return status;
+}
+
+
+// flags. by default they're evaluated lazily: each flag keeps just enough
+// of the last operation that set it (the result for Z, the 9 bit result for
+// C, the low nibbles for H) and is only worked out when something reads it.
+// ops that leave a flag alone simply don't touch its slot. F itself is only
+// up to date after flags_sync(). build with -DGB_EAGER_FLAGS to compute the
+// flags straight into F instead, the two must always agree
+enum { LH_VAL, LH_ADD, LH_SUB }; // how H is derived
+
+#ifdef GB_EAGER_FLAGS
+void fl_z(gb* g, u8 res) { fZ = res == 0; }
+void fl_n(gb* g, u8 n) { fN = n; }
+void fl_h(gb* g, u8 h) { fH = h; }
+void fl_h_add(gb* g, u8 a, u8 b) { fH = (a & 0xF) + b > 0xF; }
+void fl_h_sub(gb* g, u8 a, u8 b) { fH = (a & 0xF) < b; }
+void fl_c(gb* g, u8 c) { fC = c; }
+void fl_c9(gb* g, u16 wide) { fC = wide >> 8 & 1; }
+
+u8 flag_z(gb* g) { return fZ; }
+u8 flag_n(gb* g) { return fN; }
+u8 flag_h(gb* g) { return fH; }
+u8 flag_c(gb* g) { return fC; }
+
+void flags_sync(gb* g) { (void)g; }
+void flags_load(gb* g) { (void)g; }
+#else
+// Z from the result, N as is
+void fl_z(gb* g, u8 res) { g->lf_z = res; }
+void fl_n(gb* g, u8 n) { g->lf_n = n; }
+// H as is, or from a + b / a - b where b is the low nibble plus carry in
+void fl_h(gb* g, u8 h) {
+    g->lf_hk = LH_VAL;
+    g->lf_ha = h;
+}
+void fl_h_add(gb* g, u8 a, u8 b) {
+    g->lf_hk = LH_ADD;
+    g->lf_ha = a;
+    g->lf_hb = b;
+}
+void fl_h_sub(gb* g, u8 a, u8 b) {
+    g->lf_hk = LH_SUB;
+    g->lf_ha = a;
+    g->lf_hb = b;
+}
+// C as is, or from bit 8 of a sum or (borrowing) difference
+void fl_c(gb* g, u8 c) { g->lf_c = c << 8; }
+void fl_c9(gb* g, u16 wide) { g->lf_c = wide; }
+
+u8 flag_z(gb* g) { return g->lf_z == 0; }
+u8 flag_n(gb* g) { return g->lf_n; }
+u8 flag_h(gb* g) {
+    if (g->lf_hk == LH_ADD) return (g->lf_ha & 0xF) + g->lf_hb > 0xF;
+    if (g->lf_hk == LH_SUB) return (g->lf_ha & 0xF) < g->lf_hb;
+    return g->lf_ha;
+}
+u8 flag_c(gb* g) { return g->lf_c >> 8 & 1; }
+
+// materializes F for push af, save states and the debugger
+void flags_sync(gb* g) {
+    F = flag_z(g) << 7 | flag_n(g) << 6 | flag_h(g) << 5 | flag_c(g) << 4;
+}
+
+// takes the flags from F after pop af or a state load
+void flags_load(gb* g) {
+    fl_z(g, !fZ);
+    fl_n(g, fN);
+    fl_h(g, fH);
+    fl_c(g, fC);
+}
+#endif
+
+void bitchk(gb* g, u8 reg, u8 b) {
+    fl_z(g, reg & (1 << b));
+    fl_h(g, 1);
+    fl_n(g, 0);
+    PC += 2;
 }
 
-//
-void load_rom(gb* g, const char* filename) {
-    FILE* file = fopen(filename, "rb");
-    if (file == NULL) {
-        fprintf(stderr, "Failed to open ROM: %s\n", filename);
-        exit(1);
+void ld(gb* g, u8* r1, u8* r2) {
+    *r1 = *r2;
+    PC++;
+}
+
+// event scheduler. peripherals post their next state change as an event on
+// cpu_ticks and the cpu runs straight-line until the earliest one is due. the
+// queue is a binary min-heap over the event types, each type is queued at
+// most once so posting it again just moves its deadline
+int ev_before(gb* g, int i, int j) {
+    return g->ev_when[g->ev_heap[i]] < g->ev_when[g->ev_heap[j]];
+}
+
+void ev_swap(gb* g, int i, int j) {
+    u8 t = g->ev_heap[i];
+    g->ev_heap[i] = g->ev_heap[j];
+    g->ev_heap[j] = t;
+    g->ev_pos[g->ev_heap[i]] = i;
+    g->ev_pos[g->ev_heap[j]] = j;
+}
+
+void ev_sift(gb* g, int i) {
+    while (i > 0 && ev_before(g, i, (i - 1) / 2)) {
+        ev_swap(g, i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        int l = i * 2 + 1, r = l + 1, m = i;
+        if (l < g->ev_len && ev_before(g, l, m)) m = l;
+        if (r < g->ev_len && ev_before(g, r, m)) m = r;
+        if (m == i) break;
+        ev_swap(g, i, m);
+        i = m;
     }
+    g->next_event = g->ev_len ? g->ev_when[g->ev_heap[0]] : ~0ull;
+}
 
-    fseek(file, 0, SEEK_END);
-    long size = ftell(file);
-    /*printf("rom size: %ld\n", size);*/
-    rewind(file);
+void sched_add(gb* g, u8 ev, u64 when) {
+    if (when < g->next_event) g->block_break = 1;
+    g->ev_when[ev] = when;
+    if (!g->ev_queued[ev]) {
+        g->ev_queued[ev] = 1;
+        g->ev_pos[ev] = g->ev_len;
+        g->ev_heap[g->ev_len++] = ev;
+    }
+    ev_sift(g, g->ev_pos[ev]);
+}
+
+void sched_cancel(gb* g, u8 ev) {
+    if (!g->ev_queued[ev]) return;
+    int i = g->ev_pos[ev];
+    g->ev_queued[ev] = 0;
+    ev_swap(g, i, --g->ev_len);
+    if (i < g->ev_len) ev_sift(g, i);
+    else g->next_event = g->ev_len ? g->ev_when[g->ev_heap[0]] : ~0ull;
+}
+
+// interrupt lines. irq_pending caches whether interrupts() has anything to
+// do: an enabled, requested interrupt with IME on, or an EI about to take
+// effect. it's recomputed whenever IE, IF or IME change, so the cpu loop only
+// tests one byte per instruction
+void irq_update(gb* g) {
+    g->irq_pending =
+        (g->irq_en && (REG_INTE & REG_INTF & 0x1F)) || g->enable_int;
+    g->block_break |= g->irq_pending;
+}
+
+void irq_raise(gb* g, u8 mask) {
+    REG_INTF |= mask;
+    irq_update(g);
+}
+
+// scanline ppu. each line is 456 cycles: oam scan (mode 2), drawing (mode 3)
+// and hblank (mode 0), followed by 10 lines of vblank (mode 1). a line is
+// drawn in one go into g->pix when mode 3 ends
+#define LCDC_ON 0x80
+#define LCDC_WIN_MAP 0x40
+#define LCDC_WIN 0x20
+#define LCDC_TILES 0x10
+#define LCDC_BG_MAP 0x08
+#define LCDC_OBJ_16 0x04
+#define LCDC_OBJ 0x02
+#define LCDC_BG 0x01
+
+// 2bpp tile decoding. a tile row is two bytes, the low and high bit planes,
+// with the leftmost pixel in bit 7. the decoders expand all 8 rows of a tile
+// into 64 colour indices at once. -DGB_NO_SIMD builds the plain C one
+#if defined(__AVX2__) && !defined(GB_NO_SIMD)
+// two rows per 128 bit lane: each plane byte is broadcast to 8 lanes, tested
+// against its pixel's bit, and the two planes are merged
+void decode_tile(const u8* src, u8* dst) {
+    const __m256i bits = _mm256_set1_epi64x(0x0102040810204080);
+    const __m256i weight = _mm256_setr_epi64x(0x0101010101010101,
+                                              0x0202020202020202,
+                                              0x0101010101010101,
+                                              0x0202020202020202);
+    __m128i x = _mm_loadu_si128((const __m128i*)src);
+    for (int half = 0; half < 2; half++) {
+        // lane 0 holds rows 0-1 (4-5), lane 1 rows 2-3 (6-7)
+        __m256i v = _mm256_set_m128i(_mm_srli_si128(x, 4), x);
+        v = _mm256_unpacklo_epi8(v, v);
+        v = _mm256_unpacklo_epi16(v, v);
+        __m256i r0 = _mm256_unpacklo_epi32(v, v); // lo x8, hi x8 of row 0 / 2
+        __m256i r1 = _mm256_unpackhi_epi32(v, v); // row 1 / 3
+        r0 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_and_si256(r0, bits), bits), weight);
+        r1 = _mm256_and_si256(
+            _mm256_cmpeq_epi8(_mm256_and_si256(r1, bits), bits), weight);
+        r0 = _mm256_or_si256(r0, _mm256_srli_si256(r0, 8));
+        r1 = _mm256_or_si256(r1, _mm256_srli_si256(r1, 8));
+        _mm256_storeu_si256((__m256i*)&dst[half * 32],
+                            _mm256_unpacklo_epi64(r0, r1));
+        x = _mm_srli_si128(x, 8);
+    }
+}
+#elif defined(__SSE2__) && !defined(GB_NO_SIMD)
+// same as above, two rows at a time
+void decode_tile(const u8* src, u8* dst) {
+    const __m128i bits = _mm_set1_epi64x(0x0102040810204080);
+    const __m128i weight =
+        _mm_set_epi64x(0x0202020202020202, 0x0101010101010101);
+    __m128i x = _mm_loadu_si128((const __m128i*)src);
+    for (int i = 0; i < 4; i++) {
+        __m128i v = _mm_unpacklo_epi8(x, x);
+        v = _mm_unpacklo_epi16(v, v);
+        __m128i r0 = _mm_unpacklo_epi32(v, v);
+        __m128i r1 = _mm_unpackhi_epi32(v, v);
+        r0 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(r0, bits), bits),
+                           weight);
+        r1 = _mm_and_si128(_mm_cmpeq_epi8(_mm_and_si128(r1, bits), bits),
+                           weight);
+        r0 = _mm_or_si128(r0, _mm_srli_si128(r0, 8));
+        r1 = _mm_or_si128(r1, _mm_srli_si128(r1, 8));
+        _mm_storeu_si128((__m128i*)&dst[i * 16], _mm_unpacklo_epi64(r0, r1));
+        x = _mm_srli_si128(x, 4);
+    }
+}
+#else
+// spreads the bits of a plane byte into the bytes of a u64, bit 7 landing in
+// the lowest byte
+u64 spread_bits(u8 b) {
+    u64 x = (b * 0x0101010101010101ull) & 0x0102040810204080ull;
+    return ((x + 0x7F7F7F7F7F7F7F7Full) >> 7) & 0x0101010101010101ull;
+}
 
-    g->rom = (u8*)malloc(size);
-    size_t read_size = fread(g->rom, sizeof(uint8_t), size, file);
-    if (read_size != size) { printf("Failed to read the entire file\n"); }
-    fclose(file);
+void decode_tile(const u8* src, u8* dst) {
+    for (int row = 0; row < 8; row++) {
+        u64 v = spread_bits(src[row * 2]) | spread_bits(src[row * 2 + 1]) << 1;
+        memcpy(&dst[row * 8], &v, 8); // little endian: byte 0 is pixel 0
+    }
+}
+#endif
 
-    for (int i = 0; i < sizeof(bootrom) / sizeof(bootrom[0]); i++) {
-        g->rom[i] = bootrom[i];
+// decoded colour indices of tile t, redecoded only after vram writes to it
+const u8* tile_data(gb* g, u16 t) {
+    if (g->tile_dirty[t]) {
+        decode_tile(&g->vram[t * 16], g->tiles[t]);
+        g->tile_dirty[t] = 0;
     }
+    return g->tiles[t];
 }
 
-void bitchk(gb* g, u8 reg, u8 b) {
-    if (((reg >> b) & 0x1) == 1) fZ = 0;
-    else fZ = 1;
-    fH = 1;
-    fN = 0;
-    PC += 2;
+// tile data index for a bg/window map entry, 0x8800 mode uses signed indices
+u16 bg_tile(gb* g, u8 id) {
+    return (REG_LCDC & LCDC_TILES) ? id : (u16)(256 + (s8)id);
 }
 
-void ld(gb* g, u8* r1, u8* r2) {
-    *r1 = *r2;
-    PC++;
+// the window keeps its own line counter, it only advances on lines where
+// the window is actually drawn
+int window_on_line(gb* g) {
+    return (REG_LCDC & LCDC_BG) && (REG_LCDC & LCDC_WIN) &&
+           REG_SCANLINE >= REG_WINY && REG_WINX - 7 < DISPLAY_WIDTH;
+}
+
+void render_line(gb* g) {
+    u8 ly = REG_SCANLINE;
+    u8* out = &g->pix[ly * DISPLAY_WIDTH];
+    u8 bg[DISPLAY_WIDTH]; // colour index before the palette, for obj priority
+    memset(bg, 0, sizeof(bg));
+
+    if (REG_LCDC & LCDC_BG) {
+        const u8* map = &g->vram[(REG_LCDC & LCDC_BG_MAP) ? 0x1C00 : 0x1800];
+        u8 y = ly + REG_SCY;
+        for (int x = 0; x < DISPLAY_WIDTH;) {
+            u8 sx = x + REG_SCX;
+            const u8* row =
+                tile_data(g, bg_tile(g, map[(y / 8) * 32 + sx / 8])) +
+                y % 8 * 8;
+            for (int px = sx % 8; px < 8 && x < DISPLAY_WIDTH; px++)
+                bg[x++] = row[px];
+        }
+
+        int wx = REG_WINX - 7;
+        if (window_on_line(g)) {
+            const u8* wmap =
+                &g->vram[(REG_LCDC & LCDC_WIN_MAP) ? 0x1C00 : 0x1800];
+            u8 y = g->win_line++;
+            for (int x = wx < 0 ? 0 : wx; x < DISPLAY_WIDTH;) {
+                u8 sx = x - wx;
+                const u8* row =
+                    tile_data(g, bg_tile(g, wmap[(y / 8) * 32 + sx / 8])) +
+                    y % 8 * 8;
+                for (int px = sx % 8; px < 8 && x < DISPLAY_WIDTH; px++)
+                    bg[x++] = row[px];
+            }
+        }
+    }
+    for (int x = 0; x < DISPLAY_WIDTH; x++)
+        out[x] = (REG_BGRDPAL >> (bg[x] * 2)) & 3;
+
+    if (!(REG_LCDC & LCDC_OBJ)) return;
+
+    // up to 10 objects per line in oam order, then drawn with the lowest x
+    // (first in oam on ties) winning each pixel
+    u8 h = (REG_LCDC & LCDC_OBJ_16) ? 16 : 8;
+    u8 objs[10];
+    int n = 0;
+    for (int i = 0; i < 40 && n < 10; i++) {
+        int y = ly - (g->oam[i * 4] - 16);
+        if (y >= 0 && y < h) objs[n++] = i;
+    }
+    for (int i = 1; i < n; i++) { // insertion sort keeps oam order on ties
+        u8 o = objs[i];
+        int j = i - 1;
+        for (; j >= 0 && g->oam[objs[j] * 4 + 1] > g->oam[o * 4 + 1]; j--)
+            objs[j + 1] = objs[j];
+        objs[j + 1] = o;
+    }
+
+    u8 taken[DISPLAY_WIDTH];
+    memset(taken, 0, sizeof(taken));
+    for (int i = 0; i < n; i++) {
+        const u8* o = &g->oam[objs[i] * 4];
+        u8 attr = o[3];
+        u8 row = ly - (o[0] - 16);
+        if (attr & 0x40) row = h - 1 - row; // y flip
+        u16 t = (h == 16) ? ((o[2] & 0xFE) + row / 8) : o[2];
+        u8 pal = (attr & 0x10) ? REG_OBJPAL1 : REG_OBJPAL0;
+        const u8* pixels = tile_data(g, t) + row % 8 * 8;
+
+        for (int px = 0; px < 8; px++) {
+            int x = o[1] - 8 + px;
+            if (x < 0 || x >= DISPLAY_WIDTH || taken[x]) continue;
+            u8 c = pixels[(attr & 0x20) ? 7 - px : px];
+            if (!c) continue;
+            taken[x] = 1;
+            if ((attr & 0x80) && bg[x]) continue; // behind bg colours 1-3
+            out[x] = (pal >> (c * 2)) & 3;
+        }
+    }
+}
+
+void stat_irq(gb* g, u8 cond) {
+    if (REG_LCDSTAT & cond) irq_raise(g, 0x02);
+}
+
+void set_mode(gb* g, u8 mode) {
+    g->ppu_mode = mode;
+    REG_LCDSTAT = (REG_LCDSTAT & ~0x03) | mode;
+    if (mode == 0) stat_irq(g, 0x08);
+    else if (mode == 1) stat_irq(g, 0x10);
+    else if (mode == 2) stat_irq(g, 0x20);
+}
+
+void set_line(gb* g, u8 ly) {
+    REG_SCANLINE = ly;
+    if (ly == REG_LYC) {
+        REG_LCDSTAT |= 0x04;
+        stat_irq(g, 0x40);
+    } else REG_LCDSTAT &= ~0x04;
+}
+
+// one ppu mode change, the next one is scheduled from this deadline so the
+// line timing never drifts with instruction lengths
+void ppu_event(gb* g) {
+    u64 now = g->ev_when[EV_PPU];
+    switch (g->ppu_mode) {
+    case 2:
+        set_mode(g, 3);
+        sched_add(g, EV_PPU, now + 172);
+        break;
+    case 3:
+        if (!g->skip_render) render_line(g);
+        else if (window_on_line(g)) g->win_line++;
+        set_mode(g, 0);
+        sched_add(g, EV_PPU, now + 204);
+        break;
+    case 0:
+        set_line(g, REG_SCANLINE + 1);
+        if (REG_SCANLINE == DISPLAY_HEIGHT) {
+            set_mode(g, 1);
+            irq_raise(g, 0x01); // vblank
+            sched_add(g, EV_PPU, now + 456);
+        } else {
+            set_mode(g, 2);
+            sched_add(g, EV_PPU, now + 80);
+        }
+        break;
+    case 1:
+        if (REG_SCANLINE == 153) {
+            set_line(g, 0);
+            g->win_line = 0;
+            g->frame_ready = 1;
+            set_mode(g, 2);
+            sched_add(g, EV_PPU, now + 80);
+        } else {
+            set_line(g, REG_SCANLINE + 1);
+            sched_add(g, EV_PPU, now + 456);
+        }
+        break;
+    }
+}
+
+// cpu_ticks at which the ppu finishes the frame it is on, when line 153 ends
+u64 frame_end(gb* g) {
+    u64 end = g->ev_when[EV_PPU] + (153 - REG_SCANLINE) * 456;
+    if (g->ppu_mode == 2) end += 172 + 204;
+    if (g->ppu_mode == 3) end += 204;
+    return end;
+}
+
+void lcdc_write(gb* g, u8 v) {
+    u8 was_on = REG_LCDC & LCDC_ON;
+    REG_LCDC = v;
+    if (!was_on && (v & LCDC_ON)) { // restart at the top of the frame
+        set_line(g, 0);
+        g->win_line = 0;
+        set_mode(g, 2);
+        sched_add(g, EV_PPU, g->cpu_ticks + 80);
+    } else if (was_on && !(v & LCDC_ON)) {
+        set_line(g, 0);
+        set_mode(g, 0);
+        sched_cancel(g, EV_PPU);
+    }
+}
+
+// timer. DIV is the top byte of a 16 bit counter running at the cpu clock,
+// TIMA counts falling edges of one of its bits. neither is stepped: DIV is
+// derived from cpu_ticks when read and TIMA is brought up to date lazily,
+// with the overflow posted as an event
+static const u16 tima_period[4] = {1024, 16, 64, 256};
+
+u8 div_read(gb* g) { return (g->cpu_ticks - g->div_base) >> 8; }
+
+// TIMA increments between div_base-relative times t0 and t1
+u64 tima_edges(gb* g, u64 t0, u64 t1) {
+    u16 p = tima_period[REG_TIM_TAC & 3];
+    return (t1 - g->div_base) / p - (t0 - g->div_base) / p;
+}
+
+void timer_sync(gb* g) {
+    u64 now = g->cpu_ticks;
+    if (REG_TIM_TAC & 0x04) {
+        u64 n = tima_edges(g, g->tima_ticks, now);
+        while (n) {
+            u64 left = 0x100 - REG_TIM_TIMA;
+            if (n < left) {
+                REG_TIM_TIMA += n;
+                break;
+            }
+            n -= left;
+            REG_TIM_TIMA = REG_TIM_TMA; // overflow reloads and interrupts
+            irq_raise(g, 0x04);
+        }
+    }
+    g->tima_ticks = now;
+}
+
+// posts the next TIMA overflow
+void timer_schedule(gb* g) {
+    if (!(REG_TIM_TAC & 0x04)) {
+        sched_cancel(g, EV_TIMER);
+        return;
+    }
+    u16 p = tima_period[REG_TIM_TAC & 3];
+    u64 edge = (g->cpu_ticks - g->div_base) / p + (0x100 - REG_TIM_TIMA);
+    sched_add(g, EV_TIMER, g->div_base + edge * p);
+}
+
+void timer_event(gb* g) {
+    timer_sync(g);
+    timer_schedule(g);
+}
+
+void timer_write(gb* g, u16 a, u8 v) {
+    timer_sync(g);
+    if (a == 0xFF04) g->div_base = g->tima_ticks = g->cpu_ticks;
+    else g->hram[a - 0xFF00] = v;
+    timer_schedule(g);
+}
+
+// builds the page table. every 256 byte page of the address space points
+// straight at its backing memory, so plain loads and stores are a single
+// indexed lookup. NULL pages (i/o registers, writes to the cartridge) fall
+// back to io_read/io_write
+void map_memory(gb* g) {
+    for (int p = 0x00; p < 0x80; p++) g->wmap[p] = NULL; // mbc registers
+    for (int p = 0x80; p < 0xA0; p++) // vram
+        g->rmap[p] = g->wmap[p] = &g->vram[(p - 0x80) << 8];
+    // tile data writes have to invalidate the decoded tile cache
+    for (int p = 0x80; p < 0x98; p++) g->wmap[p] = NULL;
+    for (int p = 0xC0; p < 0xE0; p++) // wram
+        g->rmap[p] = g->wmap[p] = &g->wram[(p - 0xC0) << 8];
+    for (int p = 0xE0; p < 0xFE; p++) // echo of wram
+        g->rmap[p] = g->wmap[p] = &g->wram[(p - 0xE0) << 8];
+    g->rmap[0xFE] = g->wmap[0xFE] = g->oam; // oam + unusable area
+    g->rmap[0xFF] = g->wmap[0xFF] = NULL;   // i/o + high ram
+    map_banks(g);                           // rom, eram and the boot rom
+    // wram is writable everywhere again, so no block decoded from it holds
+    for (int i = 0; i < 0x20; i++) g->wram_gen[i]++;
+}
+
+// joypad. P1 bits 4 and 5 select the d-pad and the buttons, the low nibble
+// reads 0 for each pressed key on a selected line
+u8 joy_read(gb* g) {
+    u8 sel = REG_JOYP & 0x30, keys = 0;
+    if (!(sel & 0x10)) keys |= g->buttons & 0x0F;
+    if (!(sel & 0x20)) keys |= g->buttons >> 4;
+    return 0xC0 | sel | (~keys & 0x0F);
+}
+
+// the frontend's current input, a mask of BTN_* held down. a key going down
+// on a selected line requests the joypad interrupt
+void gb_set_input(gb* g, u8 buttons) {
+    u8 before = joy_read(g);
+    g->buttons = buttons;
+    if (before & ~joy_read(g) & 0x0F) irq_raise(g, 0x10);
+}
+
+u8 io_read(gb* g, u16 a) {
+    if (a == 0xFF00) return joy_read(g);
+    if (a == 0xFF04) return div_read(g);
+    if (a == 0xFF05) timer_sync(g);
+    if (a >= 0xFF00) return g->hram[a - 0xFF00];
+    if (a >= 0xA000 && a < 0xC000 && g->ram_enable && g->has_rtc &&
+        g->ram_bank >= 0x08 && g->ram_bank <= 0x0C)
+        return g->rtc_latched[g->ram_bank - 0x08];
+    return 0xFF;
 }
 
 // u8 read - the way gb memory is setup you need to go to different locations
-// based on address
+// based on address, the page table does that lookup for us
 u8 r8(gb* g, u16 a) {
-    if (a >= 0x0000 && a <= 0x3fff) {    // Accessing rom bank 1 or bootrom
-        if (a < 0x100) return g->rom[a]; // TODO: fix this
-        else return g->rom[a];
-    } else if (a >= 0x4000 && a <= 0x7fff) { // ROM Bank 01-NN
-        return g->rom[a]; // TODO: implement offset for mem bank switching
-    } else if (a >= 0x8000 && a <= 0x9fff) { // VRAM
-        return g->vram[a - 0x8000];
-    } else if (a >= 0xA000 && a <= 0xbfff) { // ERAM
-        return g->eram[a - 0xa000];
-    } else if (a >= 0xC000 && a <= 0xdfff) { // WRAM
-        return g->wram[a - 0xc000];
-    } else if (a >= 0xe000 && a <= 0xefff) { // TODO: should be echo ram..
-        return g->rom[a];
-    } else if (a >= 0xF000 && a <= 0xFFFF) { // oam / I/O
-        if (a == 0xFF44) return 0x90;
-        else if (a <= 0xFE9F) return g->oam[a - 0xF000];
-        else return g->hram[a - 0xFF00];
-    } else {
-        printf("trying to access memory not implemented or bad: %x\n", a);
-        exit(1);
-    }
-}
-
-u8* r8p(gb* g, u16 a) {
-    if (a >= 0x0000 && a <= 0x3fff) {     // Accessing rom bank 1 or bootrom
-        if (a < 0x100) return &g->rom[a]; // TODO: fix this
-        else return &g->rom[a];
-    } else if (a >= 0x4000 && a <= 0x7fff) { // ROM Bank 01-NN
-        return &g->rom[a]; // TODO: implement offset for mem bank switching
-    } else if (a >= 0x8000 && a <= 0x9fff) { // VRAM
-        return &g->vram[a - 0x8000];
-    } else if (a >= 0xA000 && a <= 0xbfff) { // ERAM
-        return &g->eram[a - 0xa000];
-    } else if (a >= 0xC000 && a <= 0xdfff) { // WRAM
-        return &g->wram[a - 0xc000];
-    } else if (a >= 0xe000 && a <= 0xefff) { // TODO: should be echo ram..
-        return &g->rom[a];
-    } else if (a >= 0xF000 && a <= 0xFFFF) { // oam / I/O
-        if (a <= 0xFE9F) return &g->oam[a - 0xF000];
-        else return &g->hram[a - 0xFF00];
-    } else {
-        printf("trying to access memory not implemented or bad: %x\n", a);
-        exit(1);
-    }
+    const u8* p = g->rmap[a >> 8];
+    if (p) return p[a & 0xFF];
+    return io_read(g, a);
 }
 
+// immediate operands are fetched with the opcode, see fetch_imm()
 u8 f8(gb* g) {
-    u8 v = r8(g, PC + 1);
     PC += 2;
-    return v;
+    return g->imm;
 }
 
 void lda(gb* g, u8* r1, u16* r2) {
@@ -163,67 +760,140 @@ void ldahl(gb* g, u8* r1, s8 i) {
     HL += i;
 }
 
-u16 r16(gb* g, u16 a) {
-    if (a >= 0x0000 && a <= 0x3fff) { // Accessing rom bank 1 or bootrom
-        if (a < 0x100) return g->rom[a + 1] << 8 | g->rom[a]; // TODO: fix this
-        else return g->rom[a + 1] << 8 | g->rom[a];
-    } else if (a >= 0x4000 && a <= 0x7fff) { // ROM Bank 01-NN
-        return g->rom[a + 1] << 8 |
-               g->rom[a]; // TODO: implement offset for mem bank switching
-    } else if (a >= 0x8000 && a <= 0x9fff) { // VRAM
-        return g->vram[a + 1 - 0x8000] << 8 | g->vram[a - 0x8000];
-    } else if (a >= 0xA000 && a <= 0xbfff) { // ERAM
-        return g->eram[a + 1 - 0xA000] << 8 | g->eram[a - 0xa000];
-    } else if (a >= 0xC000 && a <= 0xdfff) { // WRAM
-        return g->wram[a + 1 - 0xC000] << 8 | g->wram[a - 0xc000];
-    } else if (a >= 0xF000 && a <= 0xFFFF) { // oam / I/O
-        if (a <= 0xFE9F)
-            return g->oam[a + 1 - 0xF000] << 8 | g->oam[a - 0xF000];
-        else return g->hram[a + 1 - 0xFF00] << 8 | g->hram[a - 0xFF00];
-    } else {
-        printf("trying to access memory r16 not implemented or "
-               "bad: %x\n",
-               a);
-        exit(1);
-    }
-}
+u16 r16(gb* g, u16 a) { return r8(g, a + 1) << 8 | r8(g, a); }
 
 u16 f16(gb* g) {
-    u16 v = r16(g, PC + 1);
-    /*u16 v = (u16)g->rom[PC + 2] << 8 | g->rom[PC + 1];*/
     PC += 3;
-    return v;
+    return g->imm;
 }
 
-void w8(gb* g, u16 a, u8 v) {
-    /*if (a == 0xff01) printf("%c", v);*/
-    /*if (a == 0xff40) printf("writing to 0xff40: %x", v);*/
-    if (a >= 0x0000 && a <= 0x3fff) {
-        if (a < 0x100) g->rom[a] = v; // TODO: fix this
-        else g->rom[a] = v;
-    } else if (a >= 0x4000 && a <= 0x7fff) { // ROM Bank 01-NN
-        g->rom[a] = v; // TODO: implement offset for mem bank switching
-    } else if (a >= 0x8000 && a <= 0x9fff) { // VRAM
+// length of the instruction starting with op. the table counts the cb
+// prefix as an instruction of its own
+u8 op_bytes(u8 op) { return op == 0xCB ? 2 : opcs[op].bytes; }
+
+// reads the operand of the instruction at PC into g->imm
+void fetch_imm(gb* g, u8 op) {
+    u8 n = op_bytes(op);
+    if (n == 2) g->imm = r8(g, PC + 1);
+    else if (n == 3) g->imm = r16(g, PC + 1);
+}
+
+// oam dma copies 160 bytes from v << 8 into oam. it takes 640 cycles, the
+// copy happens in one go when the transfer ends
+void dma_event(gb* g) {
+    u16 src = REG_OAMDMA << 8;
+    for (int i = 0; i < 0xA0; i++) g->oam[i] = r8(g, src + i);
+}
+
+// serial link. there is nothing on the other end of the cable: the outgoing
+// byte is kept for the test harness when the transfer starts and the transfer
+// completes 8 bits at 8192Hz later
+void serial_transfer(gb* g) {
+    if (g->serial_len == sizeof(g->serial) - 1) {
+        // keep the tail, that is where test roms print their verdict
+        memmove(g->serial, g->serial + sizeof(g->serial) / 2,
+                sizeof(g->serial) / 2);
+        g->serial_len -= sizeof(g->serial) / 2;
+    }
+    g->serial[g->serial_len++] = REG_SERIAL;
+    g->serial[g->serial_len] = 0;
+    sched_add(g, EV_SERIAL, g->cpu_ticks + 8 * 512);
+}
+
+void serial_event(gb* g) {
+    REG_SERIAL = 0xFF; // nothing shifted in
+    REG_SERIAL_CNTL &= ~0x80;
+    irq_raise(g, 0x08);
+}
+
+// runs every event that is due
+void sched_dispatch(gb* g) {
+    g->event_ticks = g->cpu_ticks;
+    while (g->next_event <= g->cpu_ticks) {
+        u8 ev = g->ev_heap[0];
+        sched_cancel(g, ev);
+        switch (ev) {
+        case EV_PPU: ppu_event(g); break;
+        case EV_TIMER: timer_event(g); break;
+        case EV_SERIAL: serial_event(g); break;
+        case EV_DMA: dma_event(g); break;
+        case EV_END: g->run_done = 1; break;
+        }
+    }
+}
+
+// wram pages are write protected while blocks decoded from them are cached,
+// see run_block(). the first write drops those blocks and unprotects the page
+void code_write(gb* g, u16 a, u8 v) {
+    u8 i = (a >> 8) & 0x1F;
+    g->wram[a & 0x1FFF] = v;
+    g->wram_gen[i]++;
+    if (!page_watched(g, 0xC0 + i)) g->wmap[0xC0 + i] = &g->wram[i << 8];
+    if (0xE0 + i < 0xFE && !page_watched(g, 0xE0 + i))
+        g->wmap[0xE0 + i] = &g->wram[i << 8];
+    g->block_break = 1;
+}
+
+// a write to a watched address stops the run once the instruction is done
+void watch_hit(gb* g, u16 a) {
+    g->dbg_stop = DBG_WATCH;
+    g->dbg_addr = a;
+    sched_add(g, EV_END, g->cpu_ticks);
+}
+
+void io_write(gb* g, u16 a, u8 v) {
+    if (g->debug && bit_test(g->debug->watch, a)) watch_hit(g, a);
+    if (a < 0x8000) {
+        mbc_write(g, a, v);
+    } else if (a < 0xA000) {
         g->vram[a - 0x8000] = v;
-    } else if (a >= 0xA000 && a <= 0xbfff) { // ERAM
-        g->eram[a - 0xa000] = v;
-    } else if (a >= 0xC000 && a <= 0xdfff) { // WRAM
-        g->wram[a - 0xc000] = v;
-
-        /*if (a == 0xD802) printf("trying to write to 0xD802: %x\n", v);*/
-    } else if (a >= 0xe000 && a <= 0xefff) {
-        g->rom[a] = v;                       // TODO: this should be echo ram?
-    } else if (a >= 0xF000 && a <= 0xFFFF) { // oam / I/O
-        if (a <= 0xFE9F) g->oam[a - 0xF000] = v;
-        else g->hram[a - 0xFF00] = v;
-    } else {
-        printf("trying to write memory not implemented or bad: "
-               "%x\n",
-               a);
-        exit(1);
+        if (a < 0x9800) g->tile_dirty[(a - 0x8000) / 16] = 1;
+    } else if (a >= 0xC000 && a < 0xFE00) {
+        code_write(g, a, v);
+    } else if (a >= 0xA000 && a < 0xC000) {
+        u8* ram = eram_bank(g);
+        if (g->ram_enable && g->has_rtc && g->ram_bank >= 0x08 &&
+            g->ram_bank <= 0x0C) {
+            rtc_sync(g);
+            g->rtc[g->ram_bank - 0x08] = v;
+        } else if (ram) { // a watched page
+            ram[a - 0xA000] = v;
+        }
+    } else if (a < 0xFF00) { // a watched oam page
+        g->oam[a - 0xFE00] = v;
+    } else if (a == 0xFF40) {
+        lcdc_write(g, v);
+    } else if (a == 0xFF41) { // only the interrupt selects are writable
+        REG_LCDSTAT = (REG_LCDSTAT & 0x07) | (v & 0x78);
+    } else if (a == 0xFF44) { // ly is read only
+    } else if (a == 0xFF00) {
+        REG_JOYP = (REG_JOYP & 0xCF) | (v & 0x30);
+    } else if (a == 0xFF0F || a == 0xFFFF) {
+        g->hram[a - 0xFF00] = v;
+        irq_update(g);
+    } else if (a >= 0xFF04 && a <= 0xFF07) {
+        timer_write(g, a, v);
+    } else if (a == 0xFF46) {
+        REG_OAMDMA = v;
+        sched_add(g, EV_DMA, g->cpu_ticks + 640);
+    } else if (a == 0xFF50) { // boot rom off, latched until reset
+        if (!REG_BOOTROM && v) {
+            REG_BOOTROM = v;
+            map_banks(g);
+        }
+    } else if (a >= 0xFF00) {
+        g->hram[a - 0xFF00] = v;
+        // only transfers on the internal clock ever finish
+        if (a == 0xFF02 && (v & 0x81) == 0x81) serial_transfer(g);
     }
 }
 
+void w8(gb* g, u16 a, u8 v) {
+    u8* p = g->wmap[a >> 8];
+    if (p) p[a & 0xFF] = v;
+    else io_write(g, a, v);
+}
+
 void w16(gb* g, u16 a, u16 v) {
     w8(g, a, v & 0xFF);
     w8(g, a + 1, v >> 8);
@@ -272,17 +942,17 @@ void inc16(gb* g, u16* r) {
 }
 
 void inc8(gb* g, u8* r) {
-    fH = ((*r & 0x0f) + 1 > 0x0f);
+    fl_h_add(g, *r, 1);
     *r += 1;
-    fZ = (*r == 0);
-    fN = 0;
+    fl_z(g, *r);
+    fl_n(g, 0);
     PC++;
 }
 void dec8(gb* g, u8* r) {
-    fH = ((*r & 0x0f) == 0);
+    fl_h_sub(g, *r, 1);
     *r -= 1;
-    fZ = (*r == 0);
-    fN = 1;
+    fl_z(g, *r);
+    fl_n(g, 1);
     PC++;
 }
 void inca8(gb* g, u16* r) {
@@ -297,35 +967,35 @@ void deca8(gb* g, u16* r) {
 }
 
 void _add8(gb* g, u8* r1, u8* r2, u8 c) {
-    u8 r = *r1 + *r2 + c;
-    fH = (((*r1 & 0xF) + (*r2 & 0xf) + c) > 0xf) ? 1 : 0;
-    fN = 0;
-    fC = (((u16)*r1) + ((u16)*r2) + (u16)c) > 0x00ff ? 1 : 0;
+    u16 r = *r1 + *r2 + c;
+    fl_h_add(g, *r1, (*r2 & 0xF) + c);
+    fl_n(g, 0);
+    fl_c9(g, r);
     *r1 = r;
-    fZ = (*r1 == 0);
+    fl_z(g, *r1);
     PC++;
 }
 void _sub8(gb* g, u8* r1, u8* r2, u8 c) {
-    u8 r = *r1 - *r2 - c; // TODO: minus carry?
-    fZ = (r == 0);
-    fH = (((*r1 & 0xF) < (*r2 & 0xf) + c)) ? 1 : 0;
-    fN = 1;
-    fC = (((u16)*r1) < ((u16)*r2) + (u16)c) ? 1 : 0;
+    u16 r = *r1 - *r2 - c; // bit 8 is the borrow
+    fl_z(g, r);
+    fl_h_sub(g, *r1, (*r2 & 0xF) + c);
+    fl_n(g, 1);
+    fl_c9(g, r);
     *r1 = r;
     PC++;
 }
 
 void add8(gb* g, u8* r1, u8* r2) { _add8(g, r1, r2, 0); }
-void adc8(gb* g, u8* r1, u8* r2) { _add8(g, r1, r2, fC); }
+void adc8(gb* g, u8* r1, u8* r2) { _add8(g, r1, r2, flag_c(g)); }
 void sub8(gb* g, u8* r1, u8* r2) { _sub8(g, r1, r2, 0); }
-void sbc8(gb* g, u8* r1, u8* r2) { _sub8(g, r1, r2, fC); }
+void sbc8(gb* g, u8* r1, u8* r2) { _sub8(g, r1, r2, flag_c(g)); }
 
 void and8(gb* g, u8* r1, u8* r2) {
     *r1 &= *r2;
-    fZ = (*r1 == 0);
-    fN = 0;
-    fH = 1;
-    fC = 0;
+    fl_z(g, *r1);
+    fl_n(g, 0);
+    fl_h(g, 1);
+    fl_c(g, 0);
     PC++;
 }
 void andhl8(gb* g, u8* r1) {
@@ -350,10 +1020,10 @@ void addhl8(gb* g, u8* r1) {
 }
 void or8(gb* g, u8* r1, u8* r2) {
     *r1 |= *r2;
-    fZ = (*r1 == 0);
-    fN = 0;
-    fH = 0;
-    fC = 0;
+    fl_z(g, *r1);
+    fl_n(g, 0);
+    fl_h(g, 0);
+    fl_c(g, 0);
     PC++;
 }
 void orhl8(gb* g, u8* r1) {
@@ -362,10 +1032,10 @@ void orhl8(gb* g, u8* r1) {
 }
 void xor8(gb* g, u8* r1, u8* r2) {
     *r1 ^= *r2;
-    fZ = (*r1 == 0);
-    fN = 0;
-    fH = 0;
-    fC = 0;
+    fl_z(g, *r1);
+    fl_n(g, 0);
+    fl_h(g, 0);
+    fl_c(g, 0);
     PC++;
 }
 void xorhl8(gb* g, u8* r1) {
@@ -423,47 +1093,148 @@ void cpan(gb* g) {
 }
 
 void add16(gb* g, u16* r1, u16* r2) {
-    fH = ((*r1 & 0x0fff) + (*r2 & 0x0fff) > 0x0fff);
-    fN = 0;
-    fC = (*r1 > (0xffff - *r2));
+    fl_h(g, (*r1 & 0x0fff) + (*r2 & 0x0fff) > 0x0fff);
+    fl_n(g, 0);
+    fl_c(g, *r1 > (0xffff - *r2));
     *r1 += *r2;
     PC++;
 }
 void addn8sp(gb* g) {
     u8 v = f8(g);
     /*fH = ((SP & 0x000f) + (v & 0x000F) > 0x000f);*/
-    fN = 0;
+    fl_n(g, 0);
     /*fC = (SP > (0xffff - (s8)v));*/
-    fH = ((SP & 0x000f) + (v & 0x000f) > 0x000f);
-    fC = ((SP & 0x00ff) + (((u16)((s16)v)) & 0x00ff) > 0x00ff); //?
-    fZ = 0;
+    fl_h(g, (SP & 0x000f) + (v & 0x000f) > 0x000f);
+    fl_c(g, (SP & 0x00ff) + (((u16)((s16)v)) & 0x00ff) > 0x00ff); //?
+    fl_z(g, 1); // z is always cleared
     SP += (s8)v;
 }
 void f8_func(gb* g) {
     u8 v = f8(g);
     /*fH = ((SP & 0x000f) + (v & 0x000F) > 0x000f);*/
-    fN = 0;
+    fl_n(g, 0);
     /*fC = (SP > (0xffff - (s8)v));*/
-    fH = ((SP & 0x000f) + (v & 0x000f) > 0x000f);
-    fC = ((SP & 0x00ff) + (((u16)((s16)v)) & 0x00ff) > 0x00ff); //?
-    fZ = 0;
+    fl_h(g, (SP & 0x000f) + (v & 0x000f) > 0x000f);
+    fl_c(g, (SP & 0x00ff) + (((u16)((s16)v)) & 0x00ff) > 0x00ff); //?
+    fl_z(g, 1); // z is always cleared
     HL = SP + (s8)v;
 }
+// there is no joypad to wake the cpu from stop, so the run just ends there
 void stop(gb* g) {
-    printf("stop\n");
-    exit(1);
+    g->stopped = 1;
+    PC += 2;
+    sched_add(g, EV_END, g->cpu_ticks);
 }
 void j16(gb* g) {
     u16 a = f16(g);
     PC = a;
 }
+// idle loops. a short backward loop that only loads A from memory and tests
+// it comes out the same every time round until what it reads changes, and
+// between events nothing changes: the ppu registers, IF and whatever the
+// interrupt handlers write only move when an event fires. DIV and TIMA are
+// the exception, they count every cycle. such a loop is skipped whole
+// iterations at a time up to the next event. rom code never changes, so the
+// analysis is cached on the branch's host address, which also tells rom
+// banks and the boot rom apart
+
+// indirect loads, their address is only known when the loop runs
+#define IDLE_HL 1
+#define IDLE_BC 2
+#define IDLE_DE 4
+#define IDLE_C 8
+
+int idle_timer_reg(u16 a) { return a == 0xFF04 || a == 0xFF05; }
+
+// cycles one pass of the loop from PC back round to the jr at `at` takes, or
+// 0 if it isn't an idle loop
+u16 idle_scan(gb* g, u16 at, u8* ind) {
+    u16 a = PC, cost = 0;
+    u8 a_loaded = 0;
+    *ind = 0;
+    // loops crossing a page could span two banks
+    if (at - PC > 16 || (PC ^ at) & 0xFF00) return 0;
+    while (a < at) {
+        u8 op = r8(g, a), n = r8(g, a + 1);
+        switch (op) {
+        case 0x00: // nop
+        case 0xFE: // cp n
+        case 0xBF: // cp a
+        case 0xA7: // and a
+        case 0xB7: // or a
+            break;
+        case 0xE6: // and n
+        case 0xF6: // or n
+        case 0xEE: // xor n
+            // these change A, fine as long as it was reloaded first
+            if (!a_loaded) return 0;
+            break;
+        case 0xF0: // ldh a,(n)
+            if (idle_timer_reg(0xFF00 | n)) return 0;
+            a_loaded = 1;
+            break;
+        case 0xFA: // ld a,(nn)
+            if (idle_timer_reg(r16(g, a + 1))) return 0;
+            a_loaded = 1;
+            break;
+        case 0xF2: *ind |= IDLE_C; a_loaded = 1; break;  // ld a,(c)
+        case 0x7E: *ind |= IDLE_HL; a_loaded = 1; break; // ld a,(hl)
+        case 0x0A: *ind |= IDLE_BC; a_loaded = 1; break; // ld a,(bc)
+        case 0x1A: *ind |= IDLE_DE; a_loaded = 1; break; // ld a,(de)
+        case 0xCB: // bit b,a and bit b,(hl)
+            if (n < 0x40 || n > 0x7F || (n & 7) < 6) return 0;
+            if ((n & 7) == 6) *ind |= IDLE_HL;
+            cost += opcs[0x100 | n].cycles;
+            a += 2;
+            continue;
+        default: return 0;
+        }
+        cost += opcs[op].cycles_nt;
+        a += opcs[op].bytes;
+    }
+    if (a != at) return 0; // branches into the middle of an instruction
+    return cost + opcs[r8(g, at)].cycles;
+}
+
+// called after a jr at `at` branched backwards
+void idle_loop(gb* g, u16 at) {
+    const u8* key = g->rmap[at >> 8] + (at & 0xFF);
+    u8 h = (uintptr_t)key % IDLE_CACHE;
+    if (g->idle_key[h] != key) {
+        g->idle_key[h] = key;
+        g->idle_cost[h] = idle_scan(g, at, &g->idle_ind[h]);
+    }
+    u16 cost = g->idle_cost[h];
+    u8 ind = g->idle_ind[h];
+    if (!cost || g->enable_int) return;
+    // this pass has to have read what it tested after the last event
+    if (g->event_ticks > g->cpu_ticks - cost) return;
+    if (ind && (((ind & IDLE_HL) && idle_timer_reg(HL)) ||
+                ((ind & IDLE_BC) && idle_timer_reg(BC)) ||
+                ((ind & IDLE_DE) && idle_timer_reg(DE)) ||
+                ((ind & IDLE_C) && idle_timer_reg(0xFF00 | C))))
+        return;
+    if (g->next_event <= g->cpu_ticks) return;
+    u64 skip = (g->next_event - g->cpu_ticks) / cost * cost;
+    g->cpu_ticks += skip;
+    g->idle_skipped += skip;
+}
+
 void jr(gb* g) {
+    u16 at = PC;
     s8 v = f8(g);
     PC += v;
+    if (v < 0 && at < 0x8000) idle_loop(g, at);
 }
 void jump(gb* g, u16 a) { PC = a; }
+
+// conditional branches are charged their not-taken cost up front, taking
+// one adds the difference
+#define TAKEN(op) (g->cpu_ticks += opcs[op].cycles - opcs[op].cycles_nt)
+
 void jc(gb* g, u8 f) {
     if (f == 1) {
+        TAKEN(0xC2);
         j16(g);
         return;
     }
@@ -471,6 +1242,7 @@ void jc(gb* g, u8 f) {
 }
 void jnc(gb* g, u8 f) {
     if (f == 0) {
+        TAKEN(0xC2);
         j16(g);
         return;
     }
@@ -479,6 +1251,7 @@ void jnc(gb* g, u8 f) {
 
 void jrc(gb* g, u8 f) {
     if (f == 1) {
+        TAKEN(0x20);
         jr(g);
         return;
     }
@@ -487,6 +1260,7 @@ void jrc(gb* g, u8 f) {
 
 void jrnc(gb* g, u8 f) {
     if (f == 0) {
+        TAKEN(0x20);
         jr(g);
         return;
     }
@@ -500,6 +1274,7 @@ void call16(gb* g) {
 }
 void call16nc(gb* g, u8 f) {
     if (f == 0) {
+        TAKEN(0xC4);
         call16(g);
         return;
     }
@@ -507,6 +1282,7 @@ void call16nc(gb* g, u8 f) {
 }
 void call16c(gb* g, u8 f) {
     if (f == 1) {
+        TAKEN(0xC4);
         call16(g);
         return;
     }
@@ -519,6 +1295,7 @@ void ret(gb* g) {
 }
 void retc(gb* g, u8 f) {
     if (f == 1) {
+        TAKEN(0xC0);
         PC = r16(g, SP);
         SP += 2;
         return;
@@ -528,6 +1305,7 @@ void retc(gb* g, u8 f) {
 }
 void retnc(gb* g, u8 f) {
     if (f == 0) {
+        TAKEN(0xC0);
         PC = r16(g, SP);
         SP += 2;
         return;
@@ -550,39 +1328,39 @@ void pop16(gb* g, u16* r) {
 // bitwise ops
 void rl(gb* g, u8* r) {
     u8 c = ((*r >> 7) & 0x01); // carry 7th bit if needed
-    u8 v = (0xff & (*r << 1)) | fC;
+    u8 v = (0xff & (*r << 1)) | flag_c(g);
     *r = v;
-    fZ = (v == 0);
-    fH = 0;
-    fN = 0;
-    fC = c;
+    fl_z(g, v);
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_c(g, c);
     PC += 2;
 }
 void rlc(gb* g, u8* v) {        // rotate left with carry
     u8 c = ((*v >> 7) == 0x01); // carry if bit 7 set
     u8 r = (*v << 1) | c;       // shift and carry previous bit 7 into 0
-    fH = 0;
-    fN = 0;
-    fZ = (r == 0);
-    fC = c;
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_z(g, r);
+    fl_c(g, c);
     *v = r;
     PC += 2;
 }
 void rrc(gb* g, u8* v) {         // rotate right with carry
     u8 c = (*v & 0x01);          // carry if bit 0 set
     u8 r = (*v >> 1) | (c << 7); // shift and carry previous bit 0 into 7
-    fH = 0;
-    fN = 0;
-    fZ = (r == 0);
-    fC = c;
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_z(g, r);
+    fl_c(g, c);
     *v = r;
     PC += 2;
 }
 void swap(gb* g, u8* v) {
-    fZ = (*v == 0);
-    fC = 0;
-    fN = 0;
-    fH = 0;
+    fl_z(g, *v);
+    fl_c(g, 0);
+    fl_n(g, 0);
+    fl_h(g, 0);
     *v = ((*v >> 4) | (*v << 4));
     PC += 2;
 }
@@ -595,254 +1373,187 @@ void set(gb* g, u8* v, u8 i) {
     PC += 2;
 }
 void rr(gb* g, u8* r) {
-    u8 c = (*r & 0x01);           // carry lsb if there
-    u8 v = (*r >> 1) | (fC << 7); // carry shifts on if needed
+    u8 c = (*r & 0x01);                  // carry lsb if there
+    u8 v = (*r >> 1) | (flag_c(g) << 7); // carry shifts on if needed
     *r = v;
-    fZ = (v == 0);
-    fH = 0;
-    fN = 0;
-    fC = c;
+    fl_z(g, v);
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_c(g, c);
     PC += 2;
 }
 void sla(gb* g, u8* r) {
     u8 c = (*r >> 7) & 0x01; // carry 7th bit if needed
     u8 v = (*r << 1);
     *r = v;
-    fZ = (v == 0);
-    fH = 0;
-    fN = 0;
-    fC = c;
+    fl_z(g, v);
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_c(g, c);
     PC += 2;
 }
 void sra(gb* g, u8* r) {
     u8 c = (*r & 0x01);             // carry lsb if there
     u8 v = (*r >> 1) | (*r & 0x80); // TODO: what?
     *r = v;
-    fZ = (v == 0);
-    fH = 0;
-    fN = 0;
-    fC = c;
+    fl_z(g, v);
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_c(g, c);
     PC += 2;
 }
 void srl(gb* g, u8* v) { // shift right logical
     u8 c = (*v & 0x1);   // if bit 0 set
     u8 r = (*v >> 1);    // shift
-    fH = 0;
-    fN = 0;
-    fZ = (r == 0);
-    fC = c;
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_z(g, r);
+    fl_c(g, c);
     *v = r;
     PC += 2;
 }
 
 void ldhan(gb* g) { _A = r8(g, 0xFF00 + f8(g)); }
 void ldhna(gb* g) { w8(g, 0xFF00 + f8(g), _A); }
-void execute_cb(gb* g) {
-    u8 cb_opcode = r8(g, PC + 1);
-    u8 reg = cb_opcode & 0x07; // bottom three bits define reg
-    u8* regp;
-    switch (reg) {
-    case 0x00: regp = &_B; break;
-    case 0x01: regp = &C; break;
-    case 0x02: regp = &D; break;
-    case 0x03: regp = &E; break;
-    case 0x04: regp = &H; break;
-    case 0x05: regp = &L; break;
-    case 0x06: regp = r8p(g, HL); break;
-    case 0x07: regp = &_A; break;
-    default: printf("not imimasdfhsd\n"); exit(2);
-    }
-
-    u8 com = cb_opcode >> 3;
-    switch (com) {
-    case 0x00: rlc(g, regp); break;
-    case 0x01: rrc(g, regp); break;
-    case 0x02: rl(g, regp); break;
-    case 0x03: rr(g, regp); break;
-    case 0x04: sla(g, regp); break;
-    case 0x05: sra(g, regp); break;
-    case 0x06: swap(g, regp); break;
-    case 0x07: srl(g, regp); break;
-    case 0x08: bitchk(g, *regp, 0); break;
-    case 0x09: bitchk(g, *regp, 1); break;
-    case 0x0a: bitchk(g, *regp, 2); break;
-    case 0x0b: bitchk(g, *regp, 3); break;
-    case 0x0c: bitchk(g, *regp, 4); break;
-    case 0x0d: bitchk(g, *regp, 5); break;
-    case 0x0e: bitchk(g, *regp, 6); break;
-    case 0x0f: bitchk(g, *regp, 7); break;
-    case 0x10: res(g, regp, 0); break;
-    case 0x11: res(g, regp, 1); break;
-    case 0x12: res(g, regp, 2); break;
-    case 0x13: res(g, regp, 3); break;
-    case 0x14: res(g, regp, 4); break;
-    case 0x15: res(g, regp, 5); break;
-    case 0x16: res(g, regp, 6); break;
-    case 0x17: res(g, regp, 7); break;
-    case 0x18: set(g, regp, 0); break;
-    case 0x19: set(g, regp, 1); break;
-    case 0x1a: set(g, regp, 2); break;
-    case 0x1b: set(g, regp, 3); break;
-    case 0x1c: set(g, regp, 4); break;
-    case 0x1d: set(g, regp, 5); break;
-    case 0x1e: set(g, regp, 6); break;
-    case 0x1f: set(g, regp, 7); break;
-    default: printf("dafah\n"); exit(2);
+// cb prefixed ops. the low three bits of the opcode pick the operand
+// (b c d e h l (hl) a) and the upper five the operation, so the 256 handlers
+// are stamped out from the 32 operations below
+#define CB_REG_B _B
+#define CB_REG_C C
+#define CB_REG_D D
+#define CB_REG_E E
+#define CB_REG_H H
+#define CB_REG_L L
+#define CB_REG_A _A
+#define CB_R(name, r, expr)                                                    \
+    static void cb_##name##_##r(gb* g) {                                       \
+        u8* p = &CB_REG_##r;                                                   \
+        expr;                                                                  \
+    }
+// (hl) goes through memory, bit tests must not write the value back
+#define CB_HL(name, wb, expr)                                                  \
+    static void cb_##name##_HL(gb* g) {                                        \
+        u16 a = HL;                                                            \
+        u8 v = r8(g, a);                                                       \
+        u8* p = &v;                                                            \
+        expr;                                                                  \
+        if (wb) w8(g, a, v);                                                   \
     }
+#define CB_OP(name, wb, expr)                                                  \
+    CB_R(name, B, expr)                                                        \
+    CB_R(name, C, expr)                                                        \
+    CB_R(name, D, expr)                                                        \
+    CB_R(name, E, expr)                                                        \
+    CB_R(name, H, expr)                                                        \
+    CB_R(name, L, expr)                                                        \
+    CB_HL(name, wb, expr)                                                      \
+    CB_R(name, A, expr)
+
+CB_OP(rlc, 1, rlc(g, p))
+CB_OP(rrc, 1, rrc(g, p))
+CB_OP(rl, 1, rl(g, p))
+CB_OP(rr, 1, rr(g, p))
+CB_OP(sla, 1, sla(g, p))
+CB_OP(sra, 1, sra(g, p))
+CB_OP(swap, 1, swap(g, p))
+CB_OP(srl, 1, srl(g, p))
+CB_OP(bit0, 0, bitchk(g, *p, 0))
+CB_OP(bit1, 0, bitchk(g, *p, 1))
+CB_OP(bit2, 0, bitchk(g, *p, 2))
+CB_OP(bit3, 0, bitchk(g, *p, 3))
+CB_OP(bit4, 0, bitchk(g, *p, 4))
+CB_OP(bit5, 0, bitchk(g, *p, 5))
+CB_OP(bit6, 0, bitchk(g, *p, 6))
+CB_OP(bit7, 0, bitchk(g, *p, 7))
+CB_OP(res0, 1, res(g, p, 0))
+CB_OP(res1, 1, res(g, p, 1))
+CB_OP(res2, 1, res(g, p, 2))
+CB_OP(res3, 1, res(g, p, 3))
+CB_OP(res4, 1, res(g, p, 4))
+CB_OP(res5, 1, res(g, p, 5))
+CB_OP(res6, 1, res(g, p, 6))
+CB_OP(res7, 1, res(g, p, 7))
+CB_OP(set0, 1, set(g, p, 0))
+CB_OP(set1, 1, set(g, p, 1))
+CB_OP(set2, 1, set(g, p, 2))
+CB_OP(set3, 1, set(g, p, 3))
+CB_OP(set4, 1, set(g, p, 4))
+CB_OP(set5, 1, set(g, p, 5))
+CB_OP(set6, 1, set(g, p, 6))
+CB_OP(set7, 1, set(g, p, 7))
+
+#define CB_ROW(name)                                                           \
+    cb_##name##_B, cb_##name##_C, cb_##name##_D, cb_##name##_E,                \
+        cb_##name##_H, cb_##name##_L, cb_##name##_HL, cb_##name##_A,
+
+static void (*const cb_table[256])(gb*) = {
+    CB_ROW(rlc) CB_ROW(rrc) CB_ROW(rl) CB_ROW(rr)
+    CB_ROW(sla) CB_ROW(sra) CB_ROW(swap) CB_ROW(srl)
+    CB_ROW(bit0) CB_ROW(bit1) CB_ROW(bit2) CB_ROW(bit3)
+    CB_ROW(bit4) CB_ROW(bit5) CB_ROW(bit6) CB_ROW(bit7)
+    CB_ROW(res0) CB_ROW(res1) CB_ROW(res2) CB_ROW(res3)
+    CB_ROW(res4) CB_ROW(res5) CB_ROW(res6) CB_ROW(res7)
+    CB_ROW(set0) CB_ROW(set1) CB_ROW(set2) CB_ROW(set3)
+    CB_ROW(set4) CB_ROW(set5) CB_ROW(set6) CB_ROW(set7)
+};
+
+// the prefix byte was charged as an instruction of its own, add the rest of
+// the cb op's cost
+void execute_cb(gb* g) {
+    u8 op = g->imm;
+    g->cpu_ticks += opcs[0x100 | op].cycles - opcs[0xCB].cycles;
+    cb_table[op](g);
 }
 void rlca(gb* g) {
     rlc(g, &_A);
-    fZ = 0;
+    fl_z(g, 1); // z is always cleared
     PC -= 1;
 }
 void rrca(gb* g) {
     rrc(g, &_A);
-    fZ = 0;
+    fl_z(g, 1); // z is always cleared
     PC -= 1;
 }
 void rla(gb* g) {
     rl(g, &_A);
-    fZ = 0;
+    fl_z(g, 1); // z is always cleared
     PC -= 1;
 }
 void rra(gb* g) {
     rr(g, &_A);
-    fZ = 0;
+    fl_z(g, 1); // z is always cleared
     PC -= 1;
 }
-void display_tile(gb* g, u8 t, u8 y, u8 x) {
-    u64 offset = t * 16;
-    u8 y_offset = 0;
-    for (u64 i = 0x8000 + offset; i < 0x8010 + offset; i += 2) {
-        u8 p1 = r8(g, i);
-        u8 p2 = r8(g, i + 1);
-
-        for (s8 j = 7; j >= 0; j--) {
-            u8 b1 = (p1 >> j) & 0x1;
-            u8 b2 = (p2 >> j) & 0x1;
-            u8 p = b2 << 1 | b1;
-
-            u8 ps = 4;
-            /*SDL_SetRenderDrawColor(renderer, 255, 255, 255,*/
-            /*255); // White pixels*/
-            if (p == 3) SDL_SetRenderDrawColor(renderer, 15, 56, 15, 255);
-            else if (p == 2) SDL_SetRenderDrawColor(renderer, 48, 98, 48, 255);
-            else if (p == 1)
-                SDL_SetRenderDrawColor(renderer, 139, 172, 15, 255);
-            else if (p == 0) SDL_SetRenderDrawColor(renderer, 255, 255, 255, 0);
-            SDL_Rect pixel = {((x * 8) + 7 - j) * ps, ((y * 8) + y_offset) * ps,
-                              ps, ps};
-            SDL_RenderFillRect(renderer, &pixel);
-            /*printf("trying to write pixel: %x %x %x\n", p, step, y);*/
-        }
-        y_offset++;
-
-        /*printf("\n");*/
-    }
-}
-void display_tilemap(gb* g) {
-    u64 step = 0;
-    u8 x = 0;
-    // tilemap 9800-9bff or 9c00-9fff
-    // each tile map is 32x32 but only part of the screen is displayed at any
-    // point and time
-    for (u16 i = 0x9800; i < 0x9c00; i += 1) {
-        /*printf("%02x", r8(g, i));*/
-
-        if (x > 31) {
-            x = 0;
-            /*printf("\n");*/
-        }
-        u8 y = (u64)step / (u64)32;
-        /*printf("y: %x\n", y);*/
-        display_tile(g, r8(g, i), y, x);
-        x++;
-        step++;
-    }
-
-    /*for (u16 i = 0xFE00; i < 0xFEA0; i += 4) {*/
-    /**/
-    /*    u16 y_pos = r8(g, i);*/
-    /*    u16 x_pos = r8(g, i + 1);*/
-    /*    u16 tile_idx = r8(g, i + 2);*/
-    /*    u16 attr_flags = r8(g, i + 3);*/
-    /*    printf("displaying sprite at x: %x, y: %x, and tile: %x\n", x_pos /
-     * 32,*/
-    /*           y_pos / 32, tile_idx);*/
-    /*    display_tile(g, r8(g, tile_idx), y_pos, x_pos);*/
-    /*}*/
-    /*printf("\n\n");*/
-}
-
-void render_gb_display(gb* g) {
-    SDL_SetRenderDrawColor(renderer, 0, 0, 0, 255); // Black background
-    SDL_RenderClear(renderer);
-
-    SDL_SetRenderDrawColor(renderer, 255, 255, 255, 255); // White pixels
-
-    display_tilemap(g);
-    /*for (int y = 0; y < DISPLAY_HEIGHT; ++y) {*/
-    /*    for (int x = 0; x < DISPLAY_WIDTH; ++x) {*/
-    /*        if (display[y * DISPLAY_WIDTH + x]) {*/
-    /*            SDL_Rect pixel = {x * 10, y * 10, 10,*/
-    /*                              10}; // Each CHIP-8 pixel is scaled 10x10*/
-    /*            SDL_RenderFillRect(renderer, &pixel);*/
-    /*        }*/
-    /*    }*/
-    /*}*/
-
-    SDL_RenderPresent(renderer);
-}
-
-void handle_events(int* quit, gb* g) {
-    SDL_Event e;
-    while (SDL_PollEvent(&e) != 0) {
-        if (e.type == SDL_QUIT) { *quit = 1; }
-        // Handle key press events
-        if (e.type == SDL_KEYDOWN) {
-            switch (e.key.keysym.sym) {
-            case SDLK_ESCAPE: *quit = 1; break;
-            default: break;
-            }
-        }
-        // Handle key up events
-        if (e.type == SDL_KEYUP) {
-            switch (e.key.keysym.sym) {
-            default: break;
-            }
-        }
-    }
-}
 void cpl(gb* g) {
     _A = (_A ^ 0xff) & 0xff;
-    fH = 1;
-    fN = 1;
+    fl_h(g, 1);
+    fl_n(g, 1);
     PC += 1;
 }
 void ccf(gb* g) {
-    fC = !fC;
-    fH = 0;
-    fN = 0;
+    fl_c(g, !flag_c(g));
+    fl_h(g, 0);
+    fl_n(g, 0);
     PC += 1;
 } // complement carry flag
 void scf(gb* g) {
-    fH = 0;
-    fN = 0;
-    fC = 1;
+    fl_h(g, 0);
+    fl_n(g, 0);
+    fl_c(g, 1);
     PC += 1;
 }
 void daa(gb* g) {
     u8 a = _A;
-    u8 adj = fC ? 0x60 : 0x00;
-    if (fH) adj |= 0x06;
-    if (!fN) {
+    u8 adj = flag_c(g) ? 0x60 : 0x00;
+    if (flag_h(g)) adj |= 0x06;
+    if (!flag_n(g)) {
         if ((a & 0x0f) > 0x09) adj |= 0x06;
         if (a > 0x99) adj |= 0x60;
         a += adj;
     } else a -= adj;
-    fC = (adj >= 0x60);
-    fH = 0;
-    fZ = (a == 0);
+    fl_c(g, adj >= 0x60);
+    fl_h(g, 0);
+    fl_z(g, a);
     _A = a;
     PC += 1;
 }
@@ -851,10 +1562,387 @@ void rst(gb* g, u8 v) {
     push16(g, &PC);
     PC = (u16)v;
 }
+static void (*const op_table[256])(gb*);
+
+// halt sleeps until an enabled interrupt is requested. while asleep PC stays
+// on the halt and every time it comes round the clock jumps straight to the
+// next event, only an event can raise an interrupt. with IME off and an
+// interrupt already pending the cpu doesn't sleep but fails to advance PC,
+// so the next byte is fetched twice: that instruction runs with PC still on
+// the halt, its operands starting at its own opcode
+void halt(gb* g) {
+    if (REG_INTE & REG_INTF & 0x1F) {
+        u8 op = r8(g, PC + 1);
+        if (!g->halted && !g->irq_en && !g->enable_int && op != 0x76) {
+            g->cpu_ticks += opcs[op].cycles_nt;
+            g->imm = r16(g, PC + 1);
+            op_table[op](g);
+            return;
+        }
+        if (g->halted) g->cpu_instr--; // waking, not another instruction
+        g->halted = 0;
+        PC++;
+        return;
+    }
+    if (g->halted) g->cpu_instr--; // still asleep, not another instruction
+    g->halted = 1;
+    if (g->cpu_ticks < g->next_event) g->cpu_ticks = g->next_event;
+}
+
+// one handler per opcode. these are small enough that the helpers they call
+// get inlined, so every handler ends up specialized for its registers
+#define OP(n) static void op_##n(gb* g)
+
+// the cpu locks up on these. PC stays put so every later run stops here too
+OP(illegal) {
+    g->unimpl = r8(g, PC);
+    sched_add(g, EV_END, g->cpu_ticks);
+}
+
+OP(00) { nop(g); }
+OP(01) { BC = f16(g); }
+OP(02) { ldtm(g, &BC, &_A); }
+OP(03) { inc16(g, &BC); }
+OP(04) { inc8(g, &_B); }
+OP(05) { dec8(g, &_B); }
+OP(06) { _B = f8(g); }
+OP(07) { rlca(g); }
+
+OP(08) { ldtmf16(g, &SP); }
+OP(09) { add16(g, &HL, &BC); }
+OP(0A) { lda(g, &_A, &BC); }
+OP(0B) { dec16(g, &BC); }
+OP(0C) { inc8(g, &C); }
+OP(0D) { dec8(g, &C); }
+OP(0E) { C = f8(g); }
+OP(0F) { rrca(g); }
+
+OP(10) { stop(g); }
+OP(11) { DE = f16(g); }
+OP(12) { ldtm(g, &DE, &_A); }
+OP(13) { inc16(g, &DE); }
+OP(14) { inc8(g, &D); }
+OP(15) { dec8(g, &D); }
+OP(16) { D = f8(g); }
+OP(17) { rla(g); }
+
+OP(18) { jr(g); }
+OP(19) { add16(g, &HL, &DE); }
+OP(1A) { lda(g, &_A, &DE); }
+OP(1B) { dec16(g, &DE); }
+OP(1C) { inc8(g, &E); }
+OP(1D) { dec8(g, &E); }
+OP(1E) { E = f8(g); }
+OP(1F) { rra(g); }
+
+OP(20) { jrnc(g, flag_z(g)); }
+OP(21) { HL = f16(g); }
+OP(22) { ldtmhl(g, &_A, 1); }
+OP(23) { inc16(g, &HL); }
+OP(24) { inc8(g, &H); }
+OP(25) { dec8(g, &H); }
+OP(26) { H = f8(g); }
+OP(27) { daa(g); }
+
+OP(28) { jrc(g, flag_z(g)); }
+OP(29) { add16(g, &HL, &HL); }
+OP(2A) { ldahl(g, &_A, 1); }
+OP(2B) { dec16(g, &HL); }
+OP(2C) { inc8(g, &L); }
+OP(2D) { dec8(g, &L); }
+OP(2E) { L = f8(g); }
+OP(2F) { cpl(g); }
+
+OP(30) { jrnc(g, flag_c(g)); }
+OP(31) { SP = f16(g); }
+OP(32) { ldtmhl(g, &_A, -1); }
+OP(33) { inc16(g, &SP); }
+OP(34) { inca8(g, &HL); }
+OP(35) { deca8(g, &HL); }
+OP(36) { ldtm16f8(g, &HL); }
+OP(37) { scf(g); }
+
+OP(38) { jrc(g, flag_c(g)); }
+OP(39) { add16(g, &HL, &SP); }
+OP(3A) { ldahl(g, &_A, -1); }
+OP(3B) { dec16(g, &SP); }
+OP(3C) { inc8(g, &_A); }
+OP(3D) { dec8(g, &_A); }
+OP(3E) { _A = f8(g); }
+OP(3F) { ccf(g); }
+
+OP(40) { ld(g, &_B, &_B); }
+OP(41) { ld(g, &_B, &C); }
+OP(42) { ld(g, &_B, &D); }
+OP(43) { ld(g, &_B, &E); }
+OP(44) { ld(g, &_B, &H); }
+OP(45) { ld(g, &_B, &L); }
+OP(46) { lda(g, &_B, &HL); }
+OP(47) { ld(g, &_B, &_A); }
+
+OP(48) { ld(g, &C, &_B); }
+OP(49) { ld(g, &C, &C); }
+OP(4A) { ld(g, &C, &D); }
+OP(4B) { ld(g, &C, &E); }
+OP(4C) { ld(g, &C, &H); }
+OP(4D) { ld(g, &C, &L); }
+OP(4E) { lda(g, &C, &HL); }
+OP(4F) { ld(g, &C, &_A); }
+
+OP(50) { ld(g, &D, &_B); }
+OP(51) { ld(g, &D, &C); }
+OP(52) { ld(g, &D, &D); }
+OP(53) { ld(g, &D, &E); }
+OP(54) { ld(g, &D, &H); }
+OP(55) { ld(g, &D, &L); }
+OP(56) { lda(g, &D, &HL); }
+OP(57) { ld(g, &D, &_A); }
+
+OP(58) { ld(g, &E, &_B); }
+OP(59) { ld(g, &E, &C); }
+OP(5A) { ld(g, &E, &D); }
+OP(5B) { ld(g, &E, &E); }
+OP(5C) { ld(g, &E, &H); }
+OP(5D) { ld(g, &E, &L); }
+OP(5E) { lda(g, &E, &HL); }
+OP(5F) { ld(g, &E, &_A); }
+
+OP(60) { ld(g, &H, &_B); }
+OP(61) { ld(g, &H, &C); }
+OP(62) { ld(g, &H, &D); }
+OP(63) { ld(g, &H, &E); }
+OP(64) { ld(g, &H, &H); }
+OP(65) { ld(g, &H, &L); }
+OP(66) { lda(g, &H, &HL); }
+OP(67) { ld(g, &H, &_A); }
+
+OP(68) { ld(g, &L, &_B); }
+OP(69) { ld(g, &L, &C); }
+OP(6A) { ld(g, &L, &D); }
+OP(6B) { ld(g, &L, &E); }
+OP(6C) { ld(g, &L, &H); }
+OP(6D) { ld(g, &L, &L); }
+OP(6E) { lda(g, &L, &HL); }
+OP(6F) { ld(g, &L, &_A); }
+
+OP(70) { ldtm(g, &HL, &_B); }
+OP(71) { ldtm(g, &HL, &C); }
+OP(72) { ldtm(g, &HL, &D); }
+OP(73) { ldtm(g, &HL, &E); }
+OP(74) { ldtm(g, &HL, &H); }
+OP(75) { ldtm(g, &HL, &L); }
+OP(76) { halt(g); }
+OP(77) { ldtm(g, &HL, &_A); }
+
+OP(78) { ld(g, &_A, &_B); }
+OP(79) { ld(g, &_A, &C); }
+OP(7A) { ld(g, &_A, &D); }
+OP(7B) { ld(g, &_A, &E); }
+OP(7C) { ld(g, &_A, &H); }
+OP(7D) { ld(g, &_A, &L); }
+OP(7E) { lda(g, &_A, &HL); }
+OP(7F) { ld(g, &_A, &_A); }
+
+OP(80) { add8(g, &_A, &_B); }
+OP(81) { add8(g, &_A, &C); }
+OP(82) { add8(g, &_A, &D); }
+OP(83) { add8(g, &_A, &E); }
+OP(84) { add8(g, &_A, &H); }
+OP(85) { add8(g, &_A, &L); }
+OP(86) { addhl8(g, &_A); }
+OP(87) { add8(g, &_A, &_A); }
+
+OP(88) { adc8(g, &_A, &_B); }
+OP(89) { adc8(g, &_A, &C); }
+OP(8A) { adc8(g, &_A, &D); }
+OP(8B) { adc8(g, &_A, &E); }
+OP(8C) { adc8(g, &_A, &H); }
+OP(8D) { adc8(g, &_A, &L); }
+OP(8E) { adchl8(g, &_A); }
+OP(8F) { adc8(g, &_A, &_A); }
+
+OP(90) { sub8(g, &_A, &_B); }
+OP(91) { sub8(g, &_A, &C); }
+OP(92) { sub8(g, &_A, &D); }
+OP(93) { sub8(g, &_A, &E); }
+OP(94) { sub8(g, &_A, &H); }
+OP(95) { sub8(g, &_A, &L); }
+OP(96) { subhl8(g, &_A); }
+OP(97) { sub8(g, &_A, &_A); }
+
+OP(98) { sbc8(g, &_A, &_B); }
+OP(99) { sbc8(g, &_A, &C); }
+OP(9A) { sbc8(g, &_A, &D); }
+OP(9B) { sbc8(g, &_A, &E); }
+OP(9C) { sbc8(g, &_A, &H); }
+OP(9D) { sbc8(g, &_A, &L); }
+OP(9E) { sbchl8(g, &_A); }
+OP(9F) { sbc8(g, &_A, &_A); }
+
+OP(A0) { and8(g, &_A, &_B); }
+OP(A1) { and8(g, &_A, &C); }
+OP(A2) { and8(g, &_A, &D); }
+OP(A3) { and8(g, &_A, &E); }
+OP(A4) { and8(g, &_A, &H); }
+OP(A5) { and8(g, &_A, &L); }
+OP(A6) { andhl8(g, &_A); }
+OP(A7) { and8(g, &_A, &_A); }
+
+OP(A8) { xor8(g, &_A, &_B); }
+OP(A9) { xor8(g, &_A, &C); }
+OP(AA) { xor8(g, &_A, &D); }
+OP(AB) { xor8(g, &_A, &E); }
+OP(AC) { xor8(g, &_A, &H); }
+OP(AD) { xor8(g, &_A, &L); }
+OP(AE) { xorhl8(g, &_A); }
+OP(AF) { xor8(g, &_A, &_A); }
+
+OP(B0) { or8(g, &_A, &_B); }
+OP(B1) { or8(g, &_A, &C); }
+OP(B2) { or8(g, &_A, &D); }
+OP(B3) { or8(g, &_A, &E); }
+OP(B4) { or8(g, &_A, &H); }
+OP(B5) { or8(g, &_A, &L); }
+OP(B6) { orhl8(g, &_A); }
+OP(B7) { or8(g, &_A, &_A); }
+
+OP(B8) { cp8(g, &_A, &_B); }
+OP(B9) { cp8(g, &_A, &C); }
+OP(BA) { cp8(g, &_A, &D); }
+OP(BB) { cp8(g, &_A, &E); }
+OP(BC) { cp8(g, &_A, &H); }
+OP(BD) { cp8(g, &_A, &L); }
+OP(BE) { cphl8(g, &_A); }
+OP(BF) { cp8(g, &_A, &_A); }
+
+OP(C0) { retnc(g, flag_z(g)); }
+OP(C1) { pop16(g, &BC); }
+OP(C2) { jnc(g, flag_z(g)); }
+OP(C3) { j16(g); }
+OP(C4) { call16nc(g, flag_z(g)); }
+OP(C5) { push16(g, &BC); }
+OP(C6) { addn8(g); }
+OP(C7) { rst(g, 0); }
+
+OP(C8) { retc(g, flag_z(g)); }
+OP(C9) { ret(g); }
+OP(CA) { jc(g, flag_z(g)); }
+OP(CB) { execute_cb(g); }
+OP(CC) { call16c(g, flag_z(g)); }
+OP(CD) { call16(g); }
+OP(CE) { adcn8(g); }
+OP(CF) { rst(g, 8); }
+
+OP(D0) { retnc(g, flag_c(g)); }
+OP(D1) { pop16(g, &DE); }
+OP(D2) { jnc(g, flag_c(g)); }
+OP(D3) { op_illegal(g); }
+OP(D4) { call16nc(g, flag_c(g)); }
+OP(D5) { push16(g, &DE); }
+OP(D6) { subn8(g); }
+OP(D7) { rst(g, 0x10); }
+
+OP(D8) { retc(g, flag_c(g)); }
+OP(D9) { // reti, unlike ei there's no delay
+    g->irq_en = 1;
+    irq_update(g);
+    ret(g);
+}
+OP(DA) { jc(g, flag_c(g)); }
+OP(DB) { op_illegal(g); }
+OP(DC) { call16c(g, flag_c(g)); }
+OP(DD) { op_illegal(g); }
+OP(DE) { sbcn8(g); }
+OP(DF) { rst(g, 0x18); }
+
+OP(E0) { ldhna(g); }
+OP(E1) { pop16(g, &HL); }
+OP(E2) {
+    w8(g, C + 0xFF00, _A);
+    PC++;
+}
+OP(E3) { op_illegal(g); }
+OP(E4) { op_illegal(g); }
+OP(E5) { push16(g, &HL); }
+OP(E6) { andn8(g); }
+OP(E7) { rst(g, 0x20); }
+
+OP(E8) { addn8sp(g); }
+OP(E9) { jump(g, HL); }
+OP(EA) { ldtmf8(g, &_A); }
+OP(EB) { op_illegal(g); }
+OP(EC) { op_illegal(g); }
+OP(ED) { op_illegal(g); }
+OP(EE) { xorn8(g); }
+OP(EF) { rst(g, 0x28); }
+
+OP(F0) { ldhan(g); }
+OP(F1) {
+    pop16(g, &AF);
+    F = F & 0xf0; // NOTE: bottom 4 bits of f should always be 0
+    flags_load(g);
+}
+OP(F2) {
+    _A = r8(g, C + 0xFF00);
+    PC++;
+}
+OP(F3) {
+    g->irq_en = 0;
+    g->enable_int = 0;
+    irq_update(g);
+    PC++;
+}
+OP(F4) { op_illegal(g); }
+OP(F5) {
+    flags_sync(g);
+    push16(g, &AF);
+}
+OP(F6) { orn8(g); }
+OP(F7) { rst(g, 0x30); }
+
+OP(F8) { f8_func(g); }
+OP(F9) {
+    SP = HL;
+    PC += 1;
+}
+OP(FA) { ldan16(g); }
+OP(FB) {
+    g->enable_int = 1;
+    irq_update(g);
+    PC++;
+}
+OP(FC) { op_illegal(g); }
+OP(FD) { op_illegal(g); }
+OP(FE) { cpan(g); }
+OP(FF) { rst(g, 0x38); }
+
+// every opcode in order, for building the dispatch tables
+#define OPLIST(X)                                                             \
+    X(00) X(01) X(02) X(03) X(04) X(05) X(06) X(07) X(08) X(09) X(0A) X(0B) X(0C) X(0D) X(0E) X(0F)\
+    X(10) X(11) X(12) X(13) X(14) X(15) X(16) X(17) X(18) X(19) X(1A) X(1B) X(1C) X(1D) X(1E) X(1F)\
+    X(20) X(21) X(22) X(23) X(24) X(25) X(26) X(27) X(28) X(29) X(2A) X(2B) X(2C) X(2D) X(2E) X(2F)\
+    X(30) X(31) X(32) X(33) X(34) X(35) X(36) X(37) X(38) X(39) X(3A) X(3B) X(3C) X(3D) X(3E) X(3F)\
+    X(40) X(41) X(42) X(43) X(44) X(45) X(46) X(47) X(48) X(49) X(4A) X(4B) X(4C) X(4D) X(4E) X(4F)\
+    X(50) X(51) X(52) X(53) X(54) X(55) X(56) X(57) X(58) X(59) X(5A) X(5B) X(5C) X(5D) X(5E) X(5F)\
+    X(60) X(61) X(62) X(63) X(64) X(65) X(66) X(67) X(68) X(69) X(6A) X(6B) X(6C) X(6D) X(6E) X(6F)\
+    X(70) X(71) X(72) X(73) X(74) X(75) X(76) X(77) X(78) X(79) X(7A) X(7B) X(7C) X(7D) X(7E) X(7F)\
+    X(80) X(81) X(82) X(83) X(84) X(85) X(86) X(87) X(88) X(89) X(8A) X(8B) X(8C) X(8D) X(8E) X(8F)\
+    X(90) X(91) X(92) X(93) X(94) X(95) X(96) X(97) X(98) X(99) X(9A) X(9B) X(9C) X(9D) X(9E) X(9F)\
+    X(A0) X(A1) X(A2) X(A3) X(A4) X(A5) X(A6) X(A7) X(A8) X(A9) X(AA) X(AB) X(AC) X(AD) X(AE) X(AF)\
+    X(B0) X(B1) X(B2) X(B3) X(B4) X(B5) X(B6) X(B7) X(B8) X(B9) X(BA) X(BB) X(BC) X(BD) X(BE) X(BF)\
+    X(C0) X(C1) X(C2) X(C3) X(C4) X(C5) X(C6) X(C7) X(C8) X(C9) X(CA) X(CB) X(CC) X(CD) X(CE) X(CF)\
+    X(D0) X(D1) X(D2) X(D3) X(D4) X(D5) X(D6) X(D7) X(D8) X(D9) X(DA) X(DB) X(DC) X(DD) X(DE) X(DF)\
+    X(E0) X(E1) X(E2) X(E3) X(E4) X(E5) X(E6) X(E7) X(E8) X(E9) X(EA) X(EB) X(EC) X(ED) X(EE) X(EF)\
+    X(F0) X(F1) X(F2) X(F3) X(F4) X(F5) X(F6) X(F7) X(F8) X(F9) X(FA) X(FB) X(FC) X(FD) X(FE) X(FF)
+
+#define OP_ENTRY(n) op_##n,
+static void (*const op_table[256])(gb*) = {OPLIST(OP_ENTRY)};
+
 void emulate_cycle(gb* g) {
     u8 opcode = r8(g, PC);
+    fetch_imm(g, opcode);
     g->cpu_instr += 1;
-    g->cpu_ticks += opcs[opcode].cycles;
+    g->cpu_ticks += opcs[opcode].cycles_nt;
 
     /*render_gb_display(g);*/
     /*if (REG_SERIAL) printf("%x\n", REG_SERIAL);*/
@@ -863,526 +1951,1479 @@ void emulate_cycle(gb* g) {
     /*       _A, F, _B, C, D, E, H, L, SP, PC, r8(g, PC), r8(g, PC + 1),*/
     /*       r8(g, PC + 2), r8(g, PC + 3));*/
 
-    mvprintw(10, 6,
-             "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X "
-             "L:%02X SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X",
-             _A, F, _B, C, D, E, H, L, SP, PC, r8(g, PC), r8(g, PC + 1),
-             r8(g, PC + 2), r8(g, PC + 3));
-    /*if (opcode == 0xCB)*/
-    /*    printf("op: %02x - %s\n", opcs[g->rom[PC + 1] + 0xFF].num,*/
-    /*           opcs[g->rom[PC + 1] + 0xFF].name);*/
-    /*else printf("op: %02x - %s\n", opcs[opcode].num, opcs[opcode].name);*/
-
-    switch (opcode & 0xFF) {
-
-    case 0x00: nop(g); break;
-    case 0x01: BC = f16(g); break;
-    case 0x02: ldtm(g, &BC, &_A); break;
-    case 0x03: inc16(g, &BC); break;
-    case 0x04: inc8(g, &_B); break;
-    case 0x05: dec8(g, &_B); break;
-    case 0x06: _B = f8(g); break;
-    case 0x07: rlca(g); break;
-
-    case 0x08: ldtmf16(g, &SP); break;
-    case 0x09: add16(g, &HL, &BC); break;
-    case 0x0a: lda(g, &_A, &BC); break;
-    case 0x0b: dec16(g, &BC); break;
-    case 0x0c: inc8(g, &C); break;
-    case 0x0d: dec8(g, &C); break;
-    case 0x0e: C = f8(g); break;
-    case 0x0f: rrca(g); break;
-
-    case 0x10: stop(g); break;
-    case 0x11: DE = f16(g); break;
-    case 0x12: ldtm(g, &DE, &_A); break;
-    case 0x13: inc16(g, &DE); break;
-    case 0x14: inc8(g, &D); break;
-    case 0x15: dec8(g, &D); break;
-    case 0x16: D = f8(g); break;
-    case 0x17: rla(g); break;
-
-    case 0x18: jr(g); break;
-    case 0x19: add16(g, &HL, &DE); break;
-    case 0x1a: lda(g, &_A, &DE); break;
-    case 0x1b: dec16(g, &DE); break;
-    case 0x1c: inc8(g, &E); break;
-    case 0x1d: dec8(g, &E); break;
-    case 0x1e: E = f8(g); break;
-    case 0x1f: rra(g); break;
-
-    case 0x20: jrnc(g, fZ); break;
-    case 0x21: HL = f16(g); break;
-    case 0x22: ldtmhl(g, &_A, 1); break;
-    case 0x23: inc16(g, &HL); break;
-    case 0x24: inc8(g, &H); break;
-    case 0x25: dec8(g, &H); break;
-    case 0x26: H = f8(g); break;
-    case 0x27: daa(g); break;
-
-    case 0x28: jrc(g, fZ); break;
-    case 0x29: add16(g, &HL, &HL); break;
-    case 0x2a: ldahl(g, &_A, 1); break;
-    case 0x2b: dec16(g, &HL); break;
-    case 0x2c: inc8(g, &L); break;
-    case 0x2d: dec8(g, &L); break;
-    case 0x2e: L = f8(g); break;
-    case 0x2f: cpl(g); break;
-
-    case 0x30: jrnc(g, fC); break;
-    case 0x31: SP = f16(g); break;
-    case 0x32: ldtmhl(g, &_A, -1); break;
-    case 0x33: inc16(g, &SP); break;
-    case 0x34: inca8(g, &HL); break;
-    case 0x35: deca8(g, &HL); break;
-    case 0x36: ldtm16f8(g, &HL); break;
-    case 0x37: scf(g); break;
-
-    case 0x38: jrc(g, fC); break;
-    case 0x39: add16(g, &HL, &SP); break;
-    case 0x3a: ldahl(g, &_A, -1); break;
-    case 0x3b: dec16(g, &SP); break;
-    case 0x3c: inc8(g, &_A); break;
-    case 0x3d: dec8(g, &_A); break;
-    case 0x3e: _A = f8(g); break;
-    case 0x3f: ccf(g); break;
-
-    // Reg to reg ld
-    case 0x40: ld(g, &_B, &_B); break;
-    case 0x41: ld(g, &_B, &C); break;
-    case 0x42: ld(g, &_B, &D); break;
-    case 0x43: ld(g, &_B, &E); break;
-    case 0x44: ld(g, &_B, &H); break;
-    case 0x45: ld(g, &_B, &L); break;
-    case 0x46: lda(g, &_B, &HL); break;
-    case 0x47: ld(g, &_B, &_A); break;
-
-    case 0x48: ld(g, &C, &_B); break;
-    case 0x49: ld(g, &C, &C); break;
-    case 0x4a: ld(g, &C, &D); break;
-    case 0x4b: ld(g, &C, &E); break;
-    case 0x4c: ld(g, &C, &H); break;
-    case 0x4d: ld(g, &C, &L); break;
-    case 0x4e: lda(g, &C, &HL); break;
-    case 0x4f: ld(g, &C, &_A); break;
-
-    case 0x50: ld(g, &D, &_B); break;
-    case 0x51: ld(g, &D, &C); break;
-    case 0x52: ld(g, &D, &D); break;
-    case 0x53: ld(g, &D, &E); break;
-    case 0x54: ld(g, &D, &H); break;
-    case 0x55: ld(g, &D, &L); break;
-    case 0x56: lda(g, &D, &HL); break;
-    case 0x57: ld(g, &D, &_A); break;
-
-    case 0x58: ld(g, &E, &_B); break;
-    case 0x59: ld(g, &E, &C); break;
-    case 0x5a: ld(g, &E, &D); break;
-    case 0x5b: ld(g, &E, &E); break;
-    case 0x5c: ld(g, &E, &H); break;
-    case 0x5d: ld(g, &E, &L); break;
-    case 0x5e: lda(g, &E, &HL); break;
-    case 0x5f: ld(g, &E, &_A); break;
-
-    case 0x60: ld(g, &H, &_B); break;
-    case 0x61: ld(g, &H, &C); break;
-    case 0x62: ld(g, &H, &D); break;
-    case 0x63: ld(g, &H, &E); break;
-    case 0x64: ld(g, &H, &H); break;
-    case 0x65: ld(g, &H, &L); break;
-    case 0x66: lda(g, &H, &HL); break;
-    case 0x67: ld(g, &H, &_A); break;
-
-    case 0x68: ld(g, &L, &_B); break;
-    case 0x69: ld(g, &L, &C); break;
-    case 0x6a: ld(g, &L, &D); break;
-    case 0x6b: ld(g, &L, &E); break;
-    case 0x6c: ld(g, &L, &H); break;
-    case 0x6d: ld(g, &L, &L); break;
-    case 0x6e: lda(g, &L, &HL); break;
-    case 0x6f: ld(g, &L, &_A); break;
-
-    case 0x70: ldtm(g, &HL, &_B); break;
-    case 0x71: ldtm(g, &HL, &C); break;
-    case 0x72: ldtm(g, &HL, &D); break;
-    case 0x73: ldtm(g, &HL, &E); break;
-    case 0x74: ldtm(g, &HL, &H); break;
-    case 0x75: ldtm(g, &HL, &L); break;
-    case 0x76: break; // TODO: halt
-    case 0x77: ldtm(g, &HL, &_A); break;
-
-    case 0x78: ld(g, &_A, &_B); break;
-    case 0x79: ld(g, &_A, &C); break;
-    case 0x7a: ld(g, &_A, &D); break;
-    case 0x7b: ld(g, &_A, &E); break;
-    case 0x7c: ld(g, &_A, &H); break;
-    case 0x7d: ld(g, &_A, &L); break;
-    case 0x7e: lda(g, &_A, &HL); break;
-    case 0x7f: ld(g, &_A, &_A); break;
-
-    case 0x80: add8(g, &_A, &_B); break;
-    case 0x81: add8(g, &_A, &C); break;
-    case 0x82: add8(g, &_A, &D); break;
-    case 0x83: add8(g, &_A, &E); break;
-    case 0x84: add8(g, &_A, &H); break;
-    case 0x85: add8(g, &_A, &L); break;
-    case 0x86: addhl8(g, &_A); break; // halt
-    case 0x87: add8(g, &_A, &_A); break;
-
-    case 0x88: adc8(g, &_A, &_B); break;
-    case 0x89: adc8(g, &_A, &C); break;
-    case 0x8a: adc8(g, &_A, &D); break;
-    case 0x8b: adc8(g, &_A, &E); break;
-    case 0x8c: adc8(g, &_A, &H); break;
-    case 0x8d: adc8(g, &_A, &L); break;
-    case 0x8e: adchl8(g, &_A); break; // halt L); break;
-    case 0x8f: adc8(g, &_A, &_A); break;
-
-    case 0x90: sub8(g, &_A, &_B); break;
-    case 0x91: sub8(g, &_A, &C); break;
-    case 0x92: sub8(g, &_A, &D); break;
-    case 0x93: sub8(g, &_A, &E); break;
-    case 0x94: sub8(g, &_A, &H); break;
-    case 0x95: sub8(g, &_A, &L); break;
-    case 0x96: subhl8(g, &_A); break; // halt
-    case 0x97: sub8(g, &_A, &_A); break;
-
-    case 0x98: sbc8(g, &_A, &_B); break;
-    case 0x99: sbc8(g, &_A, &C); break;
-    case 0x9a: sbc8(g, &_A, &D); break;
-    case 0x9b: sbc8(g, &_A, &E); break;
-    case 0x9c: sbc8(g, &_A, &H); break;
-    case 0x9d: sbc8(g, &_A, &L); break;
-    case 0x9e: sbchl8(g, &_A); break; // halt L); break;
-    case 0x9f: sbc8(g, &_A, &_A); break;
-
-    case 0xa0: and8(g, &_A, &_B); break;
-    case 0xa1: and8(g, &_A, &C); break;
-    case 0xa2: and8(g, &_A, &D); break;
-    case 0xa3: and8(g, &_A, &E); break;
-    case 0xa4: and8(g, &_A, &H); break;
-    case 0xa5: and8(g, &_A, &L); break;
-    case 0xa6: andhl8(g, &_A); break; // halt
-    case 0xa7: and8(g, &_A, &_A); break;
-
-    case 0xa8: xor8(g, &_A, &_B); break;
-    case 0xa9: xor8(g, &_A, &C); break;
-    case 0xaa: xor8(g, &_A, &D); break;
-    case 0xab: xor8(g, &_A, &E); break;
-    case 0xac: xor8(g, &_A, &H); break;
-    case 0xad: xor8(g, &_A, &L); break;
-    case 0xae: xorhl8(g, &_A); break; // halt L); break;
-    case 0xaf: xor8(g, &_A, &_A); break;
-
-    case 0xb0: or8(g, &_A, &_B); break;
-    case 0xb1: or8(g, &_A, &C); break;
-    case 0xb2: or8(g, &_A, &D); break;
-    case 0xb3: or8(g, &_A, &E); break;
-    case 0xb4: or8(g, &_A, &H); break;
-    case 0xb5: or8(g, &_A, &L); break;
-    case 0xb6: orhl8(g, &_A); break; // halt
-    case 0xb7: or8(g, &_A, &_A); break;
-
-    case 0xb8: cp8(g, &_A, &_B); break;
-    case 0xb9: cp8(g, &_A, &C); break;
-    case 0xba: cp8(g, &_A, &D); break;
-    case 0xbb: cp8(g, &_A, &E); break;
-    case 0xbc: cp8(g, &_A, &H); break;
-    case 0xbd: cp8(g, &_A, &L); break;
-    case 0xbe: cphl8(g, &_A); break; // halt L); break;
-    case 0xbf: cp8(g, &_A, &_A); break;
-
-    case 0xC0: retnc(g, fZ); break;
-    case 0xC1: pop16(g, &BC); break;
-    case 0xC2: jnc(g, fZ); break;
-    case 0xC3: j16(g); break;
-    case 0xC4: call16nc(g, fZ); break;
-    case 0xC5: push16(g, &BC); break;
-    case 0xC6: addn8(g); break;
-    case 0xC7: rst(g, 0); break;
-    case 0xC8: retc(g, fZ); break;
-    case 0xC9: ret(g); break;
-    case 0xCA: jc(g, fZ); break;
-    case 0xCB: execute_cb(g); break;
-    case 0xCC: call16c(g, fZ); break;
-    case 0xCD: call16(g); break;
-    case 0xCE: adcn8(g); break;
-    case 0xCF: rst(g, 8); break;
-
-    case 0xD0: retnc(g, fC); break;
-    case 0xD1: pop16(g, &DE); break;
-    case 0xD2: jnc(g, fC); break;
-    case 0xD4: call16nc(g, fC); break;
-    case 0xD5: push16(g, &DE); break;
-    case 0xD6: subn8(g); break;
-    case 0xD7: rst(g, 0x10); break;
-    case 0xD8: retc(g, fC); break;
-    case 0xD9:
-        g->enable_int = 1;
-        ret(g);
-        break;
-    case 0xDA: jc(g, fC); break;
-    case 0xDC: call16c(g, fC); break;
-    case 0xDE: sbcn8(g); break;
-    case 0xDF: rst(g, 0x18); break;
-
-    case 0xE0: ldhna(g); break;
-    case 0xE1: pop16(g, &HL); break;
-    case 0xE2:
-        w8(g, C + 0xFF00, _A);
-        PC++;
-        break;
-    case 0xE5: push16(g, &HL); break;
-    case 0xE6: andn8(g); break;
-    case 0xE7: rst(g, 0x20); break;
-    case 0xE8: addn8sp(g); break;
-    case 0xE9: jump(g, HL); break;
-    case 0xEA: ldtmf8(g, &_A); break;
-    case 0xEE: xorn8(g); break;
-    case 0xEF: rst(g, 0x28); break;
-
-    case 0xF0: ldhan(g); break;
-    case 0xF1:
-        pop16(g, &AF);
-        F = F & 0xf0; // NOTE: bottom 4 bits of f should always be 0
-        break;
-    case 0xF2:
-        _A = r8(g, C + 0xFF00);
-        PC++;
-        break;
-    case 0xF3:
-        g->disable_int = 1;
-        PC++;
-        break;
-    case 0xF5: push16(g, &AF); break;
-    case 0xF6: orn8(g); break;
-    case 0xF7: rst(g, 0x30); break;
-    case 0xF8: f8_func(g); break;
-    case 0xF9:
-        SP = HL;
-        PC += 1;
-        break;
-    case 0xFA: ldan16(g); break;
-    case 0xFB:
-        g->enable_int = 1;
-        PC++;
-        break;
-    case 0xFE: cpan(g); break;
-    case 0xFF: rst(g, 0x38); break;
+    op_table[opcode](g);
+}
+// machine cycles, the 1MHz unit instruction timings are quoted in
+u64 gb_mcycles(gb* g) { return g->cpu_ticks >> 2; }
 
-    default:
-        printf("opcode not implemented: %x\n", opcode);
-        exit(1);
-        break;
+// only called when irq_pending is set. services the highest priority
+// requested interrupt, and turns IME on the instruction after an EI
+void interrupts(gb* g) {
+    u8 trig = g->irq_en ? REG_INTE & REG_INTF & 0x1F : 0;
+    if (trig) {
+        u8 bit = trig & -trig; // vblank, stat, timer, serial, joypad
+        REG_INTF &= ~bit;
+        g->irq_en = 0;
+        g->cpu_ticks += 20; // dispatch takes 5 m-cycles
+        SP -= 2;
+        w16(g, SP, PC);
+        PC = 0x40 + 8 * __builtin_ctz(bit);
+    }
+    if (g->enable_int) {
+        g->irq_en = 1;
+        g->enable_int = 0;
+    }
+    irq_update(g);
+}
+
+// debugger. with any breakpoint set run_until() steps the plain interpreter
+// and checks PC before every instruction, otherwise the fast paths run as
+// they are. watchpoints need no checks at all, see watch_map()
+void jit_state_loaded(gb* g);
+
+debug* debug_get(gb* g) {
+    if (!g->debug) g->debug = calloc(1, sizeof(debug));
+    return g->debug;
+}
+
+void gb_break(gb* g, u16 a, int on) {
+    debug* d = debug_get(g);
+    if (bit_test(d->brk, a) == !!on) return;
+    d->brk[a >> 3] ^= 1 << (a & 7);
+    d->breaks += on ? 1 : -1;
+}
+
+void gb_watch(gb* g, u16 a, int on) {
+    debug* d = debug_get(g);
+    if (bit_test(d->watch, a) == !!on) return;
+    d->watch[a >> 3] ^= 1 << (a & 7);
+    d->watches += on ? 1 : -1;
+    d->watch_pages[a >> 8] += on ? 1 : -1;
+    map_memory(g); // protects or unprotects the page
+    jit_state_loaded(g); // so does the JIT_DIFF shadow
+}
+
+// the interpreter loop of run_until(), stopping before any instruction on a
+// breakpoint. the first instruction always runs, so a run can be continued
+// from the breakpoint it stopped on
+void run_debug(gb* g, u64 end) {
+    const debug* d = g->debug;
+    sched_add(g, EV_END, end);
+    g->run_done = 0;
+    while (!g->run_done) {
+        while (g->cpu_ticks < g->next_event) {
+            emulate_cycle(g);
+            if (g->irq_pending) interrupts(g);
+            if (bit_test(d->brk, PC) && !g->halted) {
+                g->dbg_stop = DBG_BREAK;
+                g->dbg_addr = PC;
+                sched_cancel(g, EV_END);
+                return;
+            }
+        }
+        sched_dispatch(g);
     }
 }
-void interrupts(gb* g) {
 
-    u8 joydata = (~r8(g, 0xff00)) & 0xf0;
-    u8 val = 0;
-    if ((joydata >> 4) & 0x2)
-        val = (0x20) | ((joydata << 0) | (joydata << 1) | (joydata << 2) |
-                        (joydata << 3));
-    if ((joydata >> 4) & 0x1)
-        val = (0x10) | ((joydata << 0) | (joydata << 1) | (joydata << 2) |
-                        (joydata << 3));
-    if (val) REG_INTF |= 0x10;
-    w8(g, 0xff00, ~(val));
-
-    if (g->irq_en == 1) {
-        u8 trig = REG_INTE & REG_INTF;
-        if (trig) {
-            g->irq_en = 0;
-            /*halted = 0;*/
-            if (trig & 0x1) // vblank
-            {
-                g->irq_en = 0;
-                REG_INTF &= ~0x1;
-                rst(g, 0x40);
-            } else if (trig & 0x2) { // lcdstat
-                g->irq_en = 0;
-                REG_INTF &= ~0x2;
-                rst(g, 0x48);
-            } else if (trig & 0x4) { // timer
-                g->irq_en = 0;
-                REG_INTF &= ~0x4;
-                rst(g, 0x50);
-            } else if (trig & 0x10) { //  joypad
-                g->irq_en = 0;
-                REG_INTF &= ~0x10;
-                rst(g, 0x60);
-            }
+// runs a single instruction along with any events and interrupt it brings.
+// a halted cpu sleeps through to its wakeup, for at most a frame
+void gb_step(gb* g) {
+    u32 instr = g->cpu_instr;
+    u64 start = g->cpu_ticks;
+    while (g->cpu_instr == instr && !g->stopped && !g->unimpl &&
+           g->cpu_ticks - start < CYCLES_PER_FRAME) {
+        if (g->cpu_ticks >= g->next_event) sched_dispatch(g);
+        emulate_cycle(g);
+        if (g->irq_pending) interrupts(g);
+    }
+}
+
+#ifndef GB_THREADED
+// predecoded blocks. straight-line code is decoded once into its handlers,
+// operands and costs, then runs without going back through the memory map
+// for every opcode and operand. a block ends after anything that can
+// branch, at the end of its 256 byte page (the next one may be another
+// bank) or after BLOCK_MAX instructions. like the idle loop analysis blocks
+// are keyed on their host address, which tells rom banks and the boot rom
+// apart. rom never changes. a wram page is write protected through the
+// memory map once code is decoded from it and the first write into it bumps
+// its generation, dropping its blocks. other pages are never cached
+#define BLOCK_CACHE 1024
+#define BLOCK_MAX 16
+#define JIT_HOT 16 // runs before a block is worth translating
+
+typedef struct {
+    void (*fn)(gb*);
+    u16 imm;
+    u8 cycles; // charged before the handler runs, as in emulate_cycle()
+    u8 op;     // opcode, 0xCB for all the cb ops
+} block_op;
+
+typedef struct block {
+    const u8* key; // host address of the first opcode
+    u32 gen;       // wram_gen of its page when decoded, 0 for rom
+    u16 lead;      // cycles of all but the last op, which may branch
+    u8 len;
+    u16 runs;                   // times run in C, until it's translated
+    void (*code)(gb*); // its translation, see jit_translate()
+    block_op ops[BLOCK_MAX];
+} block;
+
+void jit_translate(gb* g, block* b);
+
+int block_end(u8 op) {
+    switch (op) {
+    case 0x10: case 0x76:                                  // stop, halt
+    case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // jr
+    case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: // jp
+    case 0xE9:
+    case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // call
+    case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: // ret
+    case 0xD9:
+        return 1;
+    }
+    return (op & 0xC7) == 0xC7 || op_table[op] == op_illegal; // rst
+}
+
+// decodes from `key`, `at` bytes into its page, up to the end of the block.
+// instructions straddling the page end are left to the interpreter, so a
+// block can come out empty
+void block_decode(block* b, const u8* key, u16 at, u32 gen) {
+    u16 i = 0;
+    b->key = key;
+    b->gen = gen;
+    b->len = 0;
+    b->lead = 0;
+    b->runs = 0;
+    b->code = NULL;
+    while (b->len < BLOCK_MAX) {
+        u8 op = key[i], n = op_bytes(op);
+        if (at + i + n > 0x100) break;
+        block_op* o = &b->ops[b->len++];
+        o->op = op;
+        if (op == 0xCB) { // straight to the cb handler with its whole cost
+            o->fn = cb_table[key[i + 1]];
+            o->cycles = opcs[0x100 | key[i + 1]].cycles;
+        } else {
+            o->fn = op_table[op];
+            o->cycles = opcs[op].cycles_nt;
         }
+        o->imm = n == 3 ? key[i + 2] << 8 | key[i + 1] : n == 2 ? key[i + 1] : 0;
+        b->lead += o->cycles;
+        i += n;
+        if (block_end(op) || at + i == 0x100) break;
+    }
+    if (b->len) b->lead -= b->ops[b->len - 1].cycles;
+}
+
+// write protects wram page i, so code decoded from it can be cached
+void code_protect(gb* g, u8 i) {
+    g->wmap[0xC0 + i] = NULL;
+    if (0xE0 + i < 0xFE) g->wmap[0xE0 + i] = NULL;
+}
+
+// runs the block at PC, or a single instruction if there isn't one. it stops
+// early wherever the interpreter would leave its loop, so both take the
+// interrupts and events at exactly the same instructions. anything that
+// needs the cpu to stop sets block_break: a pending interrupt, an event
+// moving closer, a bank switch or a write into cached code. only the last
+// op can branch or sleep, so when the rest of the block ends before the next
+// event the deadline doesn't have to be checked op by op
+void run_block(gb* g) {
+    u8 p = PC >> 8;
+    u8 wram = p >= 0xC0 && p < 0xFE;
+    if (p >= 0x80 && !wram) {
+        emulate_cycle(g);
+        return;
+    }
+    const u8* key = g->rmap[p] + (PC & 0xFF);
+    u32 gen = wram ? g->wram_gen[p & 0x1F] : 0;
+    block* b = &g->blocks[(uintptr_t)key % BLOCK_CACHE];
+    if (b->key != key || b->gen != gen) {
+        if (wram) code_protect(g, p & 0x1F);
+        block_decode(b, key, PC & 0xFF, gen);
+    }
+    if (!b->len) {
+        emulate_cycle(g);
+        return;
     }
 
-    if (g->enable_int == 1) {
-        g->irq_en = 1;
-        g->enable_int = 0;
+    u64 stop = g->cpu_ticks + b->lead < g->next_event ? ~0ull : g->next_event;
+    g->block_break = g->irq_pending; // still set, taken after the first op
+    if (b->code && stop == ~0ull && !g->block_break) {
+        b->code(g);
+        return;
     }
-    if (g->disable_int == 1) {
-        g->irq_en = 0;
-        g->disable_int = 0;
+    if (g->jit && ++b->runs == JIT_HOT) jit_translate(g, b);
+    for (const block_op *o = b->ops, *end = o + b->len; o < end; o++) {
+        g->cpu_instr += 1;
+        g->cpu_ticks += o->cycles;
+        g->imm = o->imm;
+        o->fn(g);
+        if (g->block_break || g->cpu_ticks >= stop) return;
     }
 }
 
-void read_csv() {
-    FILE* file = fopen("opcodes.csv", "r");
-    if (!file) {
-        printf("Could not open file\n");
-        return;
+// x86-64 translation of hot blocks. a translation does what the loop in
+// run_block() does with the costs, operands and handlers baked in: no op
+// list to walk, every handler a direct call, and the instruction, cycle and
+// PC counters only brought up to date before a handler can look at them.
+// register moves and (with lazy flags) register and immediate alu ops are
+// emitted inline, anything touching memory or i/o still calls its handler,
+// so the memory map, events and self modifying code work as before. guest
+// registers stay in the struct rather than in host registers since nearly
+// every block calls into C that reads them from there. translations only
+// run when the whole block ends before the next event, so they never have
+// to check the deadline; the block straddling an event runs in C
+#if defined(__x86_64__)
+#define JIT_ARENA (1 << 20)
+#define JIT_MAX_BLOCK 2048 // upper bound on one translation
+
+typedef struct jit {
+    u8* code; // JIT_ARENA bytes, writable only while translating
+    u32 used;
+    gb* shadow; // JIT_DIFF: the same machine, run without translations
+} jit;
+
+int jit_init(gb* g) {
+    if (!g->blocks) return -1;
+    jit* j = calloc(1, sizeof(jit));
+    if (!j) return -1;
+    j->code = mmap(NULL, JIT_ARENA, PROT_READ | PROT_EXEC,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) {
+        free(j);
+        return -1;
     }
+    g->jit = j;
+    return 0;
+}
 
-    /*printf("Attempting to read opcodes...\n");*/
+void jit_free(gb* g) {
+    jit* j = g->jit;
+    if (!j) return;
+    munmap(j->code, JIT_ARENA);
+    if (j->shadow) {
+        free(j->shadow->blocks);
+        free(j->shadow);
+    }
+    free(j);
+    g->jit = NULL;
+}
 
-    int op_count = 0;
-    char line[50];
+// emitter. g lives in rbx and guest state is addressed as [rbx + disp32].
+// instr, ticks and pc are counted up at translation time and only emitted
+// by jit_flush()
+typedef struct {
+    u8* p;
+    u8* exits[BLOCK_MAX]; // rel32 fields jumping to the epilogue
+    int nexits;
+    u32 instr;
+    u32 ticks;
+    u16 pc;
+} emit;
+
+void e8(emit* e, u8 v) { *e->p++ = v; }
+void e16(emit* e, u16 v) {
+    memcpy(e->p, &v, 2);
+    e->p += 2;
+}
+void e32(emit* e, u32 v) {
+    memcpy(e->p, &v, 4);
+    e->p += 4;
+}
+void ebytes(emit* e, const char* b, int n) {
+    memcpy(e->p, b, n);
+    e->p += n;
+}
+// opcode bytes, then a modrm byte addressing [rbx + disp32] with `reg` in
+// its reg field (a register or an opcode extension)
+void emem(emit* e, const char* op, int n, u8 reg, size_t disp) {
+    ebytes(e, op, n);
+    e8(e, 0x83 | reg << 3);
+    e32(e, disp);
+}
+void emov8(emit* e, size_t disp, u8 v) { // mov byte [disp],v
+    emem(e, "\xC6", 1, 0, disp);
+    e8(e, v);
+}
+void emov16(emit* e, size_t disp, u16 v) { // mov word [disp],v
+    emem(e, "\x66\xC7", 2, 0, disp);
+    e16(e, v);
+}
+
+void jit_flush(emit* e) {
+    if (e->instr) {
+        emem(e, "\x81", 1, 0, offsetof(gb, cpu_instr)); // add dword,imm32
+        e32(e, e->instr);
+    }
+    if (e->ticks) {
+        emem(e, "\x48\x81", 2, 0, offsetof(gb, cpu_ticks)); // add qword
+        e32(e, e->ticks);
+    }
+    if (e->pc) {
+        emem(e, "\x66\x81", 2, 0, offsetof(gb, regs) + 10); // add PC
+        e16(e, e->pc);
+    }
+    e->instr = e->ticks = e->pc = 0;
+}
+
+// offsets of the 8 bit registers in opcode order b c d e h l - a
+static const u8 reg8_byte[8] = {1, 0, 3, 2, 5, 4, 0, 7};
+size_t reg8(int r) { return offsetof(gb, regs) + reg8_byte[r]; }
+// pairs in opcode order bc de hl sp, sp being regs[4] after af. 5 is pc
+size_t reg16(int r) { return offsetof(gb, regs) + 2 * (r == 3 ? 4 : r); }
+
+#ifndef GB_EAGER_FLAGS
+// alu ops on A and a register or an immediate: add sub and xor or cp. the
+// result and flag inputs are stored the way fl_*() would store them
+int emit_alu(emit* e, u8 kind, int src, u8 imm) {
+    size_t a = reg8(7);
+    if (kind == 1 || kind == 3) return 0; // adc and sbc read the carry
+    emem(e, "\x0F\xB6", 2, 0, a);         // movzx eax,A
+    if (src < 0) {
+        e8(e, 0xB9); // mov ecx,imm
+        e32(e, imm);
+    } else {
+        emem(e, "\x0F\xB6", 2, 1, reg8(src)); // movzx ecx,r
+    }
+    if (kind >= 4 && kind < 7) { // and xor or: A op= src, H fixed, C clear
+        static const u8 ops[3] = {0x21, 0x31, 0x09}; // and xor or eax,ecx
+        e8(e, ops[kind - 4]);
+        e8(e, 0xC8);
+        emem(e, "\x88", 1, 0, a); // mov A,al
+        emem(e, "\x88", 1, 0, offsetof(gb, lf_z));
+        emov8(e, offsetof(gb, lf_n), 0);
+        emov8(e, offsetof(gb, lf_hk), LH_VAL);
+        emov8(e, offsetof(gb, lf_ha), kind == 4);
+        emov16(e, offsetof(gb, lf_c), 0);
+        return 1;
+    }
+    // add sub cp: H from the nibbles, C from the 9 bit result
+    emem(e, "\x88", 1, 0, offsetof(gb, lf_ha)); // mov lf_ha,al
+    ebytes(e, "\x89\xCA\x83\xE2\x0F", 5);       // mov edx,ecx; and edx,15
+    emem(e, "\x88", 1, 2, offsetof(gb, lf_hb)); // mov lf_hb,dl
+    ebytes(e, kind ? "\x29\xC8" : "\x01\xC8", 2); // sub/add eax,ecx
+    emem(e, "\x66\x89", 2, 0, offsetof(gb, lf_c));
+    emem(e, "\x88", 1, 0, offsetof(gb, lf_z));
+    emov8(e, offsetof(gb, lf_n), kind != 0);
+    emov8(e, offsetof(gb, lf_hk), kind ? LH_SUB : LH_ADD);
+    if (kind != 7) emem(e, "\x88", 1, 0, a);
+    return 1;
+}
+
+// inc r and dec r
+void emit_incdec(emit* e, int r, int dec) {
+    emem(e, "\x0F\xB6", 2, 0, reg8(r)); // movzx eax,r
+    emem(e, "\x88", 1, 0, offsetof(gb, lf_ha));
+    emov8(e, offsetof(gb, lf_hb), 1);
+    ebytes(e, dec ? "\x83\xE8\x01" : "\x83\xC0\x01", 3); // sub/add eax,1
+    emem(e, "\x88", 1, 0, reg8(r));
+    emem(e, "\x88", 1, 0, offsetof(gb, lf_z));
+    emov8(e, offsetof(gb, lf_n), dec);
+    emov8(e, offsetof(gb, lf_hk), dec ? LH_SUB : LH_ADD);
+}
+#else
+int emit_alu(emit* e, u8 kind, int src, u8 imm) {
+    (void)e, (void)kind, (void)src, (void)imm;
+    return 0;
+}
+#endif
+
+// emits op inline if it can be, returns 0 if it needs its handler
+int emit_inline(emit* e, const block_op* o) {
+    u8 op = o->op, r = op >> 3 & 7;
+    if (op == 0x00) { // nop
+    } else if (op >= 0x40 && op < 0x80 && op != 0x76 && (op & 7) != 6 &&
+               r != 6) { // ld r,r
+        if (r != (op & 7)) {
+            emem(e, "\x0F\xB6", 2, 0, reg8(op & 7)); // movzx eax,src
+            emem(e, "\x88", 1, 0, reg8(r));           // mov dst,al
+        }
+    } else if ((op & 0xC7) == 0x06 && op != 0x36) { // ld r,n
+        emov8(e, reg8(r), o->imm);
+    } else if ((op & 0xCF) == 0x01) { // ld rr,nn
+        emov16(e, reg16(op >> 4), o->imm);
+    } else if ((op & 0xC7) == 0x03) { // inc rr, dec rr
+        emem(e, "\x66\x83", 2, op & 8 ? 5 : 0, reg16(op >> 4));
+        e8(e, 1);
+    } else if (op >= 0x80 && op < 0xC0 && (op & 7) != 6) { // alu A,r
+        if (!emit_alu(e, r, op & 7, 0)) return 0;
+    } else if ((op & 0xC7) == 0xC6) { // alu A,n
+        if (!emit_alu(e, r, -1, o->imm)) return 0;
+#ifndef GB_EAGER_FLAGS
+    } else if ((op & 0xC6) == 0x04 && r != 6) { // inc r, dec r
+        emit_incdec(e, r, op & 1);
+#endif
+    } else if (op == 0xC3) { // jp nn, always last
+        e->pc = 0;
+        emov16(e, reg16(5), o->imm);
+        return 1;
+    } else {
+        return 0;
+    }
+    e->pc += op_bytes(op);
+    return 1;
+}
+
+// translates b into a function with the same effect as running it in
+// run_block() when it ends before the next event. a full arena is simply
+// thrown away with every translation in it, hot blocks come back soon enough
+void jit_translate(gb* g, block* b) {
+    jit* j = g->jit;
+    if (j->used + JIT_MAX_BLOCK > JIT_ARENA) {
+        for (int i = 0; i < BLOCK_CACHE; i++) g->blocks[i].code = NULL;
+        j->used = 0;
+    }
+    if (mprotect(j->code, JIT_ARENA, PROT_READ | PROT_WRITE) < 0) return;
+
+    emit e = {.p = j->code + j->used};
+    u8* start = e.p;
+    ebytes(&e, "\x53\x48\x89\xFB", 4); // push rbx (aligns the stack); rbx = g
+    for (int i = 0; i < b->len; i++) {
+        const block_op* o = &b->ops[i];
+        e.instr += 1;
+        e.ticks += o->cycles;
+        if (emit_inline(&e, o)) continue;
+        jit_flush(&e);
+        if (o->op != 0xCB && opcs[o->op].bytes > 1)
+            emov16(&e, offsetof(gb, imm), o->imm);
+        ebytes(&e, "\x48\x89\xDF\x48\xB8", 5); // mov rdi,rbx; movabs rax,fn
+        u64 fn = (uintptr_t)o->fn;
+        memcpy(e.p, &fn, 8);
+        e.p += 8;
+        ebytes(&e, "\xFF\xD0", 2); // call rax
+        if (i == b->len - 1) break;
+        emem(&e, "\x80", 1, 7, offsetof(gb, block_break)); // cmp byte,0
+        e8(&e, 0);
+        ebytes(&e, "\x0F\x85", 2); // jne epilogue
+        e.exits[e.nexits++] = e.p;
+        e32(&e, 0);
+    }
+    jit_flush(&e);
+    for (int i = 0; i < e.nexits; i++) {
+        u32 rel = e.p - (e.exits[i] + 4);
+        memcpy(e.exits[i], &rel, 4);
+    }
+    ebytes(&e, "\x5B\xC3", 2); // pop rbx; ret
+
+    j->used += (e.p - start + 15) & ~15;
+    mprotect(j->code, JIT_ARENA, PROT_READ | PROT_EXEC);
+    b->code = (void (*)(gb*))start;
+}
+
+// (re)starts the JIT_DIFF shadow as an exact copy of g. it gets its own
+// memory map and block cache, and never translates anything
+void jit_shadow(gb* g) {
+    gb* s = g->jit->shadow;
+    block* blocks = s ? s->blocks : calloc(BLOCK_CACHE, sizeof(block));
+    if (!s) s = g->jit->shadow = malloc(sizeof(gb));
+    memcpy(s, g, sizeof(gb));
+    s->blocks = blocks;
+    s->jit = NULL;
+    s->jit_mode = JIT_OFF;
+    map_memory(s);
+}
+
+// whether g and its shadow are in a different state
+int jit_differs(gb* g, gb* s) {
+    flags_sync(g);
+    flags_sync(s);
+    if (memcmp(g->regs, s->regs, sizeof(g->regs)) ||
+        g->cpu_ticks != s->cpu_ticks || g->cpu_instr != s->cpu_instr ||
+        g->next_event != s->next_event || g->irq_pending != s->irq_pending ||
+        g->halted != s->halted)
+        return 1;
+    return memcmp(g->wram, s->wram, sizeof(g->wram)) ||
+           memcmp(g->hram, s->hram, sizeof(g->hram)) ||
+           memcmp(g->vram, s->vram, sizeof(g->vram)) ||
+           memcmp(g->oam, s->oam, sizeof(g->oam)) ||
+           memcmp(g->eram, s->eram, g->eram_size);
+}
+
+// a loaded state replaces the whole machine, the shadow has to follow. so
+// does a new memory map
+void jit_state_loaded(gb* g) {
+    if (g->jit && g->jit->shadow) jit_shadow(g);
+}
+
+// run_until() for JIT_DIFF: the shadow takes every step g takes, running
+// blocks in C, and the two are compared after each. the first block to
+// disagree stops the run with RUN_DIVERGED
+void jit_diff_run(gb* g, u64 end) {
+    if (!g->jit->shadow) jit_shadow(g);
+    gb* s = g->jit->shadow;
+    sched_add(g, EV_END, end);
+    sched_add(s, EV_END, end);
+    g->run_done = s->run_done = 0;
+    while (!g->run_done && !g->jit_diverged) {
+        while (g->cpu_ticks < g->next_event) {
+            u16 at = PC;
+            run_block(g);
+            run_block(s);
+            if (g->irq_pending) interrupts(g);
+            if (s->irq_pending) interrupts(s);
+            if (jit_differs(g, s)) {
+                g->jit_diverged = 1;
+                g->jit_diverged_pc = at;
+                sched_add(g, EV_END, g->cpu_ticks);
+                break;
+            }
+        }
+        sched_dispatch(g);
+        sched_dispatch(s);
+    }
+}
+#else
+// no jit on other hosts, JIT_ON quietly runs blocks in C
+int jit_init(gb* g) {
+    (void)g;
+    return -1;
+}
+void jit_free(gb* g) { (void)g; }
+void jit_state_loaded(gb* g) { (void)g; }
+void jit_translate(gb* g, block* b) { (void)g, (void)b; }
+void jit_diff_run(gb* g, u64 end) { (void)g, (void)end; }
+#endif
+
+// runs instructions until at least `end` cycles have been emulated. between
+// events the cpu runs straight through, peripherals only get control when
+// one of their deadlines is reached
+void run_until(gb* g, u64 end) {
+    if (g->debug && g->debug->breaks) {
+        run_debug(g, end);
+        return;
+    }
+    if (!g->blocks && !g->no_blocks)
+        g->blocks = calloc(BLOCK_CACHE, sizeof(block));
+    if (g->jit_mode && !g->jit && jit_init(g) < 0) g->jit_mode = JIT_OFF;
+    if (g->jit_mode == JIT_DIFF) {
+        jit_diff_run(g, end);
+        return;
+    }
+    sched_add(g, EV_END, end);
+    g->run_done = 0;
+    while (!g->run_done) {
+        while (g->cpu_ticks < g->next_event) {
+            if (g->blocks) run_block(g);
+            else emulate_cycle(g);
+            if (g->irq_pending) interrupts(g);
+        }
+        sched_dispatch(g);
+    }
+}
 
-    // Skip the header line
-    /*fgets(line, 50, file);*/
+#else
+void jit_free(gb* g) { (void)g; }
+void jit_state_loaded(gb* g) { (void)g; }
 
-    // Read each line and parse it
-    while (fgets(line, 50, file)) {
-        char* token;
-        token = strtok(line, ",");
-        opcs[op_count].num = (u8)strtol(token, NULL, 0);
+// threaded variant: every handler jumps straight to the next one through a
+// label table (gcc computed goto) instead of returning to a central loop, so
+// each opcode gets its own indirect branch for the predictor to learn
+void run_until(gb* g, u64 end) {
+#define OP_LABEL(n) &&l_##n,
+    static void* const labels[256] = {OPLIST(OP_LABEL)};
+    u8 opcode;
+    if (g->debug && g->debug->breaks) {
+        run_debug(g, end);
+        return;
+    }
 
-        if (strpbrk(line, "CB ") != 0) {
-            opcs[op_count].prefix = 1;
-        } else {
-            opcs[op_count].prefix = 0;
+    sched_add(g, EV_END, end);
+    g->run_done = 0;
+#define DISPATCH()                                                             \
+    do {                                                                       \
+        if (g->cpu_ticks >= g->next_event) {                                   \
+            sched_dispatch(g);                                                 \
+            if (g->run_done) return;                                           \
+        }                                                                      \
+        opcode = r8(g, PC);                                                    \
+        fetch_imm(g, opcode);                                                  \
+        g->cpu_instr += 1;                                                     \
+        g->cpu_ticks += opcs[opcode].cycles_nt;                                \
+        goto* labels[opcode];                                                  \
+    } while (0)
+#define OP_BODY(n)                                                             \
+    l_##n : op_##n(g);                                                         \
+    if (g->irq_pending) interrupts(g);                                         \
+    DISPATCH();
+
+    DISPATCH();
+    OPLIST(OP_BODY)
+}
+#endif
+
+// shared-rom batches: n machines of one rom, each advanced a frame by
+// gb_batch_run_frame(), e.g. rollouts of a game with different inputs. they
+// share the rom image, the predecoded blocks and the jit's translations, so
+// one copy of each stays hot in the cache for all of them where n processes
+// would each decode and translate the same code. everything else is a whole
+// gb per machine, free to diverge; the machines are not vectorized across
+// each other. JIT_DIFF runs as JIT_ON, its shadow can't be shared
+int gb_batch_init(gb_batch* b, const char* rom, int n, u8 jit_mode) {
+    b->n = n;
+    b->g = malloc(n * sizeof(gb));
+    b->status = malloc(n * sizeof(int));
+    if (!b->g || !b->status) {
+        free(b->g);
+        free(b->status);
+        return ROM_ERR_READ;
+    }
+    gb* first = &b->g[0];
+    initialize(first);
+    int status = load_rom(first, rom);
+    if (status != ROM_OK) {
+        free(b->g);
+        free(b->status);
+        return status;
+    }
+#ifndef GB_THREADED
+    first->blocks = calloc(BLOCK_CACHE, sizeof(block));
+    first->no_blocks = !first->blocks;
+    first->jit_mode = jit_mode == JIT_DIFF ? JIT_ON : jit_mode;
+    if (first->jit_mode && jit_init(first) < 0) first->jit_mode = JIT_OFF;
+#else
+    (void)jit_mode;
+#endif
+    for (int i = 0; i < n; i++) {
+        gb* g = &b->g[i];
+        if (i) {
+            initialize(g);
+            g->rom = first->rom;
+            g->rom_size = first->rom_size;
+            g->rom_banks = first->rom_banks;
+            cart_init(g);
+            g->blocks = first->blocks;
+            g->no_blocks = first->no_blocks;
+            g->jit = first->jit;
+            g->jit_mode = first->jit_mode;
         }
+        g->batched = 1;
+        map_memory(g);
+        b->status[i] = -1;
+    }
+    return ROM_OK;
+}
 
-        token = strtok(NULL, ",");
-        strcpy(opcs[op_count].name, token);
-
-        token = strtok(NULL, ",");
-        opcs[op_count].bytes = atoi(token);
+// runs every machine that hasn't stopped for a frame, returns how many are
+// still running. status[] holds each one's gb_run_frame() result
+int gb_batch_run_frame(gb_batch* b) {
+    int running = 0;
+    for (int i = 0; i < b->n; i++) {
+        if (b->status[i] < 0) b->status[i] = gb_run_frame(&b->g[i]);
+        running += b->status[i] < 0;
+    }
+    return running;
+}
 
-        token = strtok(NULL, ",");
-        opcs[op_count].cycles = atoi(token);
+void gb_batch_free(gb_batch* b) {
+    // the first machine owns the shared parts, it goes last
+    for (int i = b->n - 1; i >= 0; i--) {
+        b->g[i].batched = i > 0;
+        unload_rom(&b->g[i]);
+    }
+    free(b->g);
+    free(b->status);
+}
 
-        token = strtok(NULL, ",");
-        strcpy(opcs[op_count].flZ, token);
+// save states. the machine is written field by field as little-endian
+// integers behind a 16 byte header, so a state loads on any host and build.
+// the rom, the memory map and the decoded tiles are not part of it, they are
+// rebuilt from the cartridge that is loaded when the state is restored
+#define STATE_MAGIC 0x54534253 // "SBST"
+#define STATE_VERSION 3
+#define STATE_HEADER 16
 
-        token = strtok(NULL, ",");
-        strcpy(opcs[op_count].flN, token);
+// the same field list is walked to save, to load, to measure a state
+// (buf == NULL) and to hash one, so they can't drift apart
+typedef struct {
+    u8* buf;
+    size_t pos;
+    size_t len;
+    u8 load;
+    u8 err;
+    u8 hashing; // feed the fields to hash instead of buf
+    u64 hash;
+    size_t serial_at; // where serial_len is in the body, see state_valid()
+} state_io;
+
+// 64-bit hash, 8 little-endian bytes at a time so it is the same on every
+// host. not cryptographic, just fast and mixed well enough that any changed
+// byte shows
+#define HASH_K 0x9E3779B97F4A7C15ull
+
+u64 hash_bytes(u64 h, const u8* p, size_t n) {
+    for (; n >= 8; p += 8, n -= 8) {
+        u64 w;
+        memcpy(&w, p, 8);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        w = __builtin_bswap64(w);
+#endif
+        h = (h ^ w) * HASH_K;
+        h ^= h >> 32;
+    }
+    u64 w = n;
+    for (size_t i = 0; i < n; i++) w |= (u64)p[i] << (i * 8 + 8);
+    h = (h ^ w) * HASH_K;
+    return h ^ h >> 32;
+}
 
-        token = strtok(NULL, ",");
-        strcpy(opcs[op_count].flH, token);
+void st_bytes(state_io* s, void* v, size_t n) {
+    if (s->hashing) {
+        s->hash = hash_bytes(s->hash, v, n);
+        s->pos += n;
+        return;
+    }
+    if (s->buf) {
+        if (s->len - s->pos < n) {
+            s->err = 1;
+            return;
+        }
+        if (s->load) memcpy(v, s->buf + s->pos, n);
+        else memcpy(s->buf + s->pos, v, n);
+    }
+    s->pos += n;
+}
+
+// integers of 1-8 bytes, least significant byte first
+void st_int(state_io* s, void* v, int n) {
+    u8 b[8];
+    u64 x = 0;
+    if (!s->load) {
+        switch (n) {
+        case 1: x = *(u8*)v; break;
+        case 2: x = *(u16*)v; break;
+        case 4: x = *(u32*)v; break;
+        case 8: x = *(u64*)v; break;
+        }
+        for (int i = 0; i < n; i++) b[i] = x >> (i * 8);
+    }
+    st_bytes(s, b, n);
+    if (!s->load || s->err || !s->buf) return;
+    for (int i = 0; i < n; i++) x |= (u64)b[i] << (i * 8);
+    switch (n) {
+    case 1: *(u8*)v = x; break;
+    case 2: *(u16*)v = x; break;
+    case 4: *(u32*)v = x; break;
+    case 8: *(u64*)v = x; break;
+    }
+}
 
-        token = strtok(NULL, ",");
-        strcpy(opcs[op_count].flC, token);
+#define ST(s, field) st_int(s, &(field), sizeof(field))
+
+void state_fields(gb* g, state_io* s) {
+    if (!s->load) flags_sync(g);
+    // cpu
+    for (int i = 0; i < 6; i++) ST(s, g->regs[i]);
+    ST(s, g->stopped);
+    ST(s, g->halted);
+    ST(s, g->enable_int);
+    ST(s, g->irq_en);
+    ST(s, g->buttons);
+    ST(s, g->cpu_instr);
+    ST(s, g->cpu_ticks);
+    ST(s, g->frame_no);
+
+    // memory, only as much cart ram as the header declares
+    st_bytes(s, g->eram, g->eram_size);
+    st_bytes(s, g->wram, sizeof(g->wram));
+    st_bytes(s, g->vram, sizeof(g->vram));
+    st_bytes(s, g->oam, sizeof(g->oam));
+    st_bytes(s, g->hram, sizeof(g->hram));
+
+    // mapper
+    ST(s, g->rom_bank);
+    ST(s, g->bank_hi);
+    ST(s, g->mbc1_mode);
+    ST(s, g->ram_bank);
+    ST(s, g->ram_enable);
+    st_bytes(s, g->rtc, sizeof(g->rtc));
+    st_bytes(s, g->rtc_latched, sizeof(g->rtc_latched));
+    ST(s, g->rtc_latch);
+    ST(s, g->rtc_ticks);
+
+    // serial
+    s->serial_at = s->pos;
+    ST(s, g->serial_len);
+    st_bytes(s, g->serial, sizeof(g->serial));
+
+    // ppu
+    st_bytes(s, g->pix, sizeof(g->pix));
+    ST(s, g->ppu_mode);
+    ST(s, g->enable_ppu);
+    ST(s, g->win_line);
+    ST(s, g->frame_ready);
+
+    // timer
+    ST(s, g->div_base);
+    ST(s, g->tima_ticks);
+
+    // pending events. EV_END belongs to the run_until that posted it and is
+    // never saved, the heap is rebuilt from the deadlines on load
+    for (int i = 0; i < EV_END; i++) {
+        ST(s, g->ev_queued[i]);
+        ST(s, g->ev_when[i]);
+    }
+}
 
-        op_count++;
+// identifies the cartridge a state belongs to: the header checksum, the
+// global checksum and the cartridge type
+u32 state_rom_id(gb* g) {
+    return g->rom[0x14D] | g->rom[0x14E] << 8 | g->rom[0x14F] << 16 |
+           (u32)g->rom[0x147] << 24;
+}
+
+// packbits style rle: a control byte c < 0x80 is followed by c + 1 literal
+// bytes, c >= 0x80 repeats the next byte c - 0x7d times. ram is mostly long
+// runs of zeros so this is enough to shrink a state several times over.
+// the output is at most n + n / 128 + 1 bytes
+size_t rle_pack(const u8* src, size_t n, u8* dst) {
+    size_t i = 0, o = 0;
+    while (i < n) {
+        size_t run = 1;
+        while (i + run < n && run < 130 && src[i + run] == src[i]) run++;
+        if (run >= 3) {
+            dst[o++] = 0x7D + run;
+            dst[o++] = src[i];
+            i += run;
+            continue;
+        }
+        // literals up to the next run of three
+        size_t lit = 0;
+        while (i + lit < n && lit < 128) {
+            const u8* p = &src[i + lit];
+            if (i + lit + 2 < n && p[0] == p[1] && p[0] == p[2]) break;
+            lit++;
+        }
+        dst[o++] = lit - 1;
+        memcpy(&dst[o], &src[i], lit);
+        o += lit;
+        i += lit;
+    }
+    return o;
+}
+
+// returns 0 unless src unpacks to exactly n bytes
+int rle_unpack(const u8* src, size_t len, u8* dst, size_t n) {
+    size_t i = 0, o = 0;
+    while (i < len) {
+        u8 c = src[i++];
+        if (c < 0x80) {
+            size_t lit = c + 1;
+            if (len - i < lit || n - o < lit) return 0;
+            memcpy(&dst[o], &src[i], lit);
+            i += lit;
+            o += lit;
+        } else {
+            size_t run = c - 0x7D;
+            if (i == len || n - o < run) return 0;
+            memset(&dst[o], src[i++], run);
+            o += run;
+        }
     }
+    return o == n;
+}
 
-    fclose(file);
+// uncompressed size of the state body for the loaded cartridge
+size_t state_body_size(gb* g) {
+    state_io s = {0};
+    state_fields(g, &s);
+    return s.pos;
+}
 
-    // Print out the parsed data
-    /*for (int i = 0; i < op_count; i++) {*/
-    /*    printf("num: %x, name: %s, bytes: %x\n", opcs[i].num,
-     * opcs[i].name,*/
-    /*           opcs[i].bytes);*/
-    /*}*/
+// largest state gb_save_state can produce for the loaded cartridge
+size_t gb_state_bound(gb* g) {
+    size_t n = state_body_size(g);
+    return STATE_HEADER + n + n / 128 + 1;
 }
 
-int main(int argc, char** argv) {
+// writes the state into buf, optionally rle compressed (flags = STATE_RLE).
+// returns its size, or 0 if cap is too small; gb_state_bound() always fits
+size_t gb_save_state(gb* g, u8* buf, size_t cap, int flags) {
+    size_t n = state_body_size(g);
+    if (cap < STATE_HEADER) return 0;
 
-    if (argc != 2) {
-        printf("Usage: %s <ROM file>\n", argv[0]);
-        return 1;
+    state_io s = {.buf = buf + STATE_HEADER, .len = cap - STATE_HEADER};
+    u8* raw = NULL;
+    if (flags & STATE_RLE) {
+        raw = malloc(n);
+        if (!raw) return 0;
+        s.buf = raw;
+        s.len = n;
+    }
+    state_fields(g, &s);
+    size_t body = s.pos;
+    if (raw) {
+        if (cap - STATE_HEADER < n + n / 128 + 1) s.err = 1;
+        else body = rle_pack(raw, n, buf + STATE_HEADER);
+        free(raw);
+    }
+    if (s.err) return 0;
+
+    state_io h = {.buf = buf, .len = STATE_HEADER};
+    u32 magic = STATE_MAGIC, raw_len = n, rom = state_rom_id(g);
+    u16 version = STATE_VERSION, fl = flags & STATE_RLE;
+    ST(&h, magic);
+    ST(&h, version);
+    ST(&h, fl);
+    ST(&h, raw_len);
+    ST(&h, rom);
+    return STATE_HEADER + body;
+}
+
+// checks the fields of a body that would index past their arrays, before
+// any of it is loaded
+int state_valid(gb* g, const u8* body) {
+    state_io s = {0};
+    state_fields(g, &s);
+    u16 serial_len = body[s.serial_at] | body[s.serial_at + 1] << 8;
+    return serial_len < sizeof(g->serial);
+}
+
+// rebuilds everything derived from the fields of a state just loaded
+void state_loaded(gb* g) {
+    u8 queued[EV_COUNT];
+    memcpy(queued, g->ev_queued, sizeof(queued));
+    memset(g->ev_queued, 0, sizeof(g->ev_queued));
+    g->ev_len = 0;
+    g->next_event = ~0ull;
+    for (int i = 0; i < EV_END; i++)
+        if (queued[i]) sched_add(g, i, g->ev_when[i]);
+    memset(g->tile_dirty, 1, sizeof(g->tile_dirty));
+    g->event_ticks = g->cpu_ticks;
+    flags_load(g);
+    irq_update(g);
+    map_memory(g);
+    jit_state_loaded(g);
+}
+
+// restores a state saved from the same cartridge. the core is left untouched
+// unless STATE_OK is returned
+int gb_load_state(gb* g, const u8* buf, size_t len) {
+    if (len < STATE_HEADER) return STATE_ERR_SIZE;
+    state_io h = {.buf = (u8*)buf, .len = STATE_HEADER, .load = 1};
+    u32 magic = 0, raw_len = 0, rom = 0;
+    u16 version = 0, flags = 0;
+    ST(&h, magic);
+    ST(&h, version);
+    ST(&h, flags);
+    ST(&h, raw_len);
+    ST(&h, rom);
+    if (magic != STATE_MAGIC) return STATE_ERR_FORMAT;
+    if (version != STATE_VERSION) return STATE_ERR_VERSION;
+    if (rom != state_rom_id(g)) return STATE_ERR_ROM;
+    if (raw_len != state_body_size(g)) return STATE_ERR_FORMAT;
+
+    const u8* body = buf + STATE_HEADER;
+    size_t body_len = len - STATE_HEADER;
+    u8* raw = NULL;
+    if (flags & STATE_RLE) {
+        raw = malloc(raw_len);
+        if (!raw) return STATE_ERR_SIZE;
+        if (!rle_unpack(body, body_len, raw, raw_len)) {
+            free(raw);
+            return STATE_ERR_FORMAT;
+        }
+        body = raw;
+        body_len = raw_len;
+    } else if (body_len < raw_len) {
+        return STATE_ERR_SIZE;
     }
 
-    read_csv();
-
-    gb g;
-    /*printf("initializing...\n");*/
-    initialize(&g);
-
-    /*printf("loading bootrom...\n");*/
-    load_rom(&g, argv[1]);
-    init_SDL();
-
-    char title[16];
-    memcpy(title, &g.rom[0x134], sizeof(title));
-    /*printf("title: %s\n", title);*/
-    /*printf("cartridge type: %x\n", g.rom[0x147]);*/
-    /*printf("rom size: %x\n", g.rom[0x148]);*/
-    /*printf("ram size: %x\n", g.rom[0x149]);*/
-    /*printf("header checksum: %x\n", g.rom[0x14D]);*/
-
-    uint8_t checksum = 0;
-    for (uint16_t address = 0x0134; address <= 0x014C; address++) {
-        checksum = checksum - g.rom[address] - 1;
-    }
-    /*printf("calculated header checksum: %x\n", checksum);*/
-    /*for (int i = 0; i < 16; i++) {*/
-    /*  printf("%c\n", (char)g.rom[0x134 + i]);*/
-    /*}*/
-    int row, col;
-    initscr();
-    cbreak();
-    noecho();
-    getmaxyx(stdscr, row, col);
-    refresh();
-
-    WINDOW* win = newwin(row - 4, col - 4, 2, 2);
-    box(win, 0, 0);
-    int k;
-
-    char* quit_str = "q - quit";
-    mvprintw(row - 2, col - strlen(quit_str) - 4, "%s", quit_str);
-
-    start_color();
-    init_pair(1, COLOR_GREEN, COLOR_BLACK);
-    init_pair(2, COLOR_RED, COLOR_BLACK);
-    attron(COLOR_PAIR(1));
-
-    u64 count = 0;
-    int quit = 0;
-
-    while (!quit) {
-        emulate_cycle(&g);
-        interrupts(&g);
-        /*mvprintw(row / 2, (col - strlen("Hello world")) / 2, "%s",*/
-        /*         "Hello world");*/
-
-        /*mvprintw(10, 6, "PC:%04x", g.regs[5]);*/
-        mvprintw(7, 6, "step:%08x", g.cpu_instr);
-        mvprintw(8, 6, "cycl:%08x", g.cpu_ticks);
-
-        u8 x = 0;
-        u8 y = 0;
-        for (u8 i = 0; i < 0xFF; i++) {
-            if (x == 0) mvprintw(16 + y, 6, "%08x", i - y);
-
-            mvprintw(16 + y, 16 + x, "%02x", g.hram[i]);
-            x += 3;
-            if (x > 48) {
-                x = 0;
-                y++;
-            }
+    if (!state_valid(g, body)) {
+        free(raw);
+        return STATE_ERR_FORMAT;
+    }
+    state_io s = {.buf = (u8*)body, .len = body_len, .load = 1};
+    state_fields(g, &s);
+    free(raw);
+    g->serial[g->serial_len] = 0; // a corrupt state may not end it
+    state_loaded(g);
+    return STATE_OK;
+}
+
+int gb_save_state_file(gb* g, const char* path) {
+    size_t cap = gb_state_bound(g);
+    u8* buf = malloc(cap);
+    size_t n = buf ? gb_save_state(g, buf, cap, STATE_RLE) : 0;
+    if (!n) { // nothing to write, don't leave an empty file behind
+        free(buf);
+        return STATE_ERR_IO;
+    }
+    FILE* f = fopen(path, "wb");
+    int ok = f && fwrite(buf, 1, n, f) == n;
+    if (f && fclose(f)) ok = 0;
+    free(buf);
+    return ok ? STATE_OK : STATE_ERR_IO;
+}
+
+int gb_load_state_file(gb* g, const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return STATE_ERR_IO;
+    size_t cap = gb_state_bound(g), n;
+    u8* buf = malloc(cap);
+    if (!buf) {
+        fclose(f);
+        return STATE_ERR_IO;
+    }
+    n = fread(buf, 1, cap, f);
+    fclose(f);
+    int status = gb_load_state(g, buf, n);
+    free(buf);
+    return status;
+}
+
+// rewind: a ring of the machine's recent past, one entry per captured frame.
+// every `keyframe` frames the entry is the state body rle packed, in between
+// it is the xor of the body with the previous frame's. the xor is zero
+// wherever memory didn't change, which is nearly all of it, so a delta is
+// stored as runs of zeros and literals and mostly costs a few hundred bytes.
+// xor undoes itself, so the newest delta takes the newest body back a frame
+// in place. entries live in one arena allocated up front and the oldest are
+// evicted a whole keyframe group at a time, so capturing never allocates
+#define REC_KEY 0x80000000u // rewind_rec.len of a keyframe
+
+typedef struct {
+    u32 off;
+    u32 len; // | REC_KEY
+} rewind_rec;
+
+struct gb_rewind {
+    gb* g;
+    size_t body;     // state body size, the same for every frame
+    u8* last;        // body of the newest entry
+    u8* cur;         // body being captured
+    u8* enc;         // entry being encoded
+    size_t enc_cap;
+    u8* arena;
+    size_t size;
+    size_t head;     // where the next entry goes
+    rewind_rec* recs; // ring, oldest at first
+    u32 cap;
+    u32 first;
+    u32 count;
+    int keyframe;
+    int since_key;   // entries since the newest keyframe
+};
+
+u8* put_varint(u8* p, size_t v) {
+    for (; v >= 0x80; v >>= 7) *p++ = v | 0x80;
+    *p++ = v;
+    return p;
+}
+
+const u8* get_varint(const u8* p, const u8* end, size_t* v) {
+    *v = 0;
+    for (int shift = 0; p < end && shift < 64; shift += 7) {
+        *v |= (size_t)(*p & 0x7F) << shift;
+        if (!(*p++ & 0x80)) return p;
+    }
+    return NULL;
+}
+
+// the xor of a and b as pairs of varints, a run of zero bytes and a count of
+// literal bytes that follow it. fewer than 4 zeros are cheaper kept in the
+// literals, and trailing zeros aren't stored. returns 0 past cap bytes
+size_t xor_pack(const u8* a, const u8* b, size_t n, u8* dst, size_t cap) {
+    u8* o = dst;
+    size_t i = 0;
+    while (i < n) {
+        size_t z = i;
+        for (u64 x, y; z + 8 <= n; z += 8) {
+            memcpy(&x, a + z, 8);
+            memcpy(&y, b + z, 8);
+            if (x != y) break;
+        }
+        while (z < n && a[z] == b[z]) z++;
+        if (z == n) break;
+        size_t l = z, same = 0;
+        for (; l < n && same < 4; l++) same = a[l] == b[l] ? same + 1 : 0;
+        if (same == 4) l -= 4;
+        if ((size_t)(o - dst) + 20 + (l - z) > cap) return 0;
+        o = put_varint(o, z - i);
+        o = put_varint(o, l - z);
+        for (size_t k = z; k < l; k++) *o++ = a[k] ^ b[k];
+        i = l;
+    }
+    return o - dst;
+}
+
+// xors a delta from xor_pack() into buf, 0 if it doesn't fit n bytes
+int xor_apply(const u8* src, size_t len, u8* buf, size_t n) {
+    const u8* end = src + len;
+    size_t i = 0, z, l;
+    while (src < end) {
+        if (!(src = get_varint(src, end, &z)) ||
+            !(src = get_varint(src, end, &l)))
+            return 0;
+        if (z > n - i || l > n - i - z || l > (size_t)(end - src)) return 0;
+        i += z;
+        for (size_t k = 0; k < l; k++) buf[i++] ^= *src++;
+    }
+    return 1;
+}
+
+void rewind_body(gb_rewind* r, u8* body, int load) {
+    state_io s = {.buf = body, .len = r->body, .load = load};
+    state_fields(r->g, &s);
+    if (load) state_loaded(r->g);
+}
+
+// drops the oldest keyframe and the deltas that depend on it
+void rewind_evict(gb_rewind* r) {
+    do {
+        r->first = (r->first + 1) % r->cap;
+        r->count--;
+    } while (r->count && !(r->recs[r->first].len & REC_KEY));
+    if (!r->count) r->head = r->since_key = 0;
+}
+
+// room for len bytes at head, evicting as needed. entries never wrap, a gap
+// at the end of the arena is skipped
+size_t rewind_alloc(gb_rewind* r, size_t len) {
+    for (;;) {
+        if (!r->count) return r->head = 0;
+        size_t tail = r->recs[r->first].off;
+        if (r->count < r->cap) {
+            if (r->head > tail) { // free at both ends
+                if (r->size - r->head >= len) return r->head;
+                if (tail >= len) return r->head = 0;
+            } else if (tail - r->head >= len)
+                return r->head;
         }
+        rewind_evict(r);
+    }
+}
 
-        wrefresh(win);
-        /*refresh();*/
-        k = getch();
-        if (k == 113) break;
+// a ring of at most `budget` bytes with a keyframe every `keyframe` frames.
+// NULL if the budget can't hold two keyframes
+gb_rewind* gb_rewind_new(gb* g, size_t budget, int keyframe) {
+    gb_rewind* r = calloc(1, sizeof(gb_rewind));
+    if (!r) return NULL;
+    r->g = g;
+    r->body = state_body_size(g);
+    r->enc_cap = r->body + r->body / 128 + 1;
+    r->keyframe = keyframe < 1 ? 1 : keyframe;
+    size_t fixed = sizeof(gb_rewind) + 2 * r->body + r->enc_cap;
+    // an entry table for frames averaging 64 bytes, the rest is arena
+    r->cap = budget / 64 / sizeof(rewind_rec);
+    r->size = budget > fixed ? budget - fixed - r->cap * sizeof(rewind_rec)
+                             : 0;
+    if (r->size > budget || r->size < 2 * r->enc_cap || r->cap < 2 ||
+        r->size > REC_KEY) {
+        free(r);
+        return NULL;
+    }
+    r->last = malloc(r->body);
+    r->cur = malloc(r->body);
+    r->enc = malloc(r->enc_cap);
+    r->arena = malloc(r->size);
+    r->recs = malloc(r->cap * sizeof(rewind_rec));
+    if (!r->last || !r->cur || !r->enc || !r->arena || !r->recs) {
+        gb_rewind_free(r);
+        return NULL;
+    }
+    return r;
+}
+
+void gb_rewind_free(gb_rewind* r) {
+    if (!r) return;
+    free(r->last);
+    free(r->cur);
+    free(r->enc);
+    free(r->arena);
+    free(r->recs);
+    free(r);
+}
+
+// adds the machine as it is now, normally once after every frame
+void gb_rewind_capture(gb_rewind* r) {
+    rewind_body(r, r->cur, 0);
+    size_t len = 0;
+    int key = !r->count || r->since_key + 1 >= r->keyframe;
+    if (!key) len = xor_pack(r->last, r->cur, r->body, r->enc, r->enc_cap);
+    if (!len) key = 1; // no cheaper than a keyframe
+    for (;;) {
+        if (key) len = rle_pack(r->cur, r->body, r->enc);
+        size_t off = rewind_alloc(r, len);
+        if (!key && !r->count) { // evicted the keyframe this delta needs
+            key = 1;
+            continue;
+        }
+        memcpy(r->arena + off, r->enc, len);
+        r->recs[(r->first + r->count++) % r->cap] =
+            (rewind_rec){off, len | (key ? REC_KEY : 0)};
+        r->head = off + len;
+        break;
+    }
+    r->since_key = key ? 0 : r->since_key + 1;
+    u8* t = r->last;
+    r->last = r->cur;
+    r->cur = t;
+}
+
+// goes back to the entry before the newest, which is dropped. returns 0,
+// leaving the machine alone, when there is nothing further back
+int gb_rewind_step(gb_rewind* r) {
+    if (r->count < 2) return 0;
+    u32 newest = (r->first + r->count - 1) % r->cap;
+    rewind_rec* e = &r->recs[newest];
+    r->head = e->off;
+    r->count--;
+    if (!(e->len & REC_KEY)) {
+        xor_apply(r->arena + e->off, e->len, r->last, r->body);
+        r->since_key--;
+    } else {
+        // replay the previous group from its keyframe. the oldest entry is
+        // always a keyframe, so there is one
+        u32 k = r->count - 1;
+        while (!(r->recs[(r->first + k) % r->cap].len & REC_KEY)) k--;
+        rewind_rec* kr = &r->recs[(r->first + k) % r->cap];
+        rle_unpack(r->arena + kr->off, kr->len & ~REC_KEY, r->last, r->body);
+        for (u32 i = k + 1; i < r->count; i++) {
+            rewind_rec* d = &r->recs[(r->first + i) % r->cap];
+            xor_apply(r->arena + d->off, d->len, r->last, r->body);
+        }
+        r->since_key = r->count - 1 - k;
+    }
+    rewind_body(r, r->last, 1);
+    return 1;
+}
+
+// frames gb_rewind_step() can go back
+u32 gb_rewind_frames(gb_rewind* r) { return r->count ? r->count - 1 : 0; }
+
+// hash of everything a save state holds, to tell whether two machines or two
+// builds are in the same state without keeping either
+u64 gb_state_hash(gb* g) {
+    state_io s = {.hashing = 1};
+    state_fields(g, &s);
+    return s.hash;
+}
+
+// movies: the buttons held in each frame from a known start, and the state
+// hash after the frame. replaying the buttons has to reproduce every hash,
+// so a movie recorded once checks frame by frame that a change to the core
+// (the jit, lazy flags, the scheduler) didn't change what the machine does,
+// at 9 bytes a frame. the file is a header, the start state if the movie
+// doesn't start at power on, then buttons and hash for each frame
+#define MOVIE_MAGIC 0x564D4253 // "SBMV"
+#define MOVIE_VERSION 1
+#define MOVIE_HEADER 20
+#define MOVIE_FRAME 9
+
+// starts an empty movie from the machine as it is now, or from power on
+// unless from_state. the machine must not have run yet in that case
+void movie_begin(movie* m, gb* g, int from_state) {
+    memset(m, 0, sizeof(*m));
+    m->rom = state_rom_id(g);
+    if (!from_state) return;
+    size_t cap = gb_state_bound(g);
+    m->start = malloc(cap);
+    m->start_len = gb_save_state(g, m->start, cap, STATE_RLE);
+}
+
+// books a frame that ran with `buttons` held
+void movie_add(movie* m, gb* g, u8 buttons) {
+    if (m->frames == m->cap) {
+        m->cap = m->cap ? m->cap * 2 : 4096;
+        m->buttons = realloc(m->buttons, m->cap);
+        m->hashes = realloc(m->hashes, m->cap * sizeof(u64));
+    }
+    m->buttons[m->frames] = buttons;
+    m->hashes[m->frames++] = gb_state_hash(g);
+}
+
+void movie_free(movie* m) {
+    free(m->buttons);
+    free(m->hashes);
+    free(m->start);
+    memset(m, 0, sizeof(*m));
+}
+
+int movie_save(movie* m, const char* path) {
+    size_t len = MOVIE_HEADER + m->start_len + (size_t)m->frames * MOVIE_FRAME;
+    u8* buf = malloc(len);
+    if (!buf) return STATE_ERR_IO;
+    state_io s = {.buf = buf, .len = len};
+    u32 magic = MOVIE_MAGIC, start_len = m->start_len;
+    u16 version = MOVIE_VERSION, flags = 0;
+    ST(&s, magic);
+    ST(&s, version);
+    ST(&s, flags);
+    ST(&s, m->rom);
+    ST(&s, m->frames);
+    ST(&s, start_len);
+    if (m->start_len) st_bytes(&s, m->start, m->start_len);
+    for (u32 i = 0; i < m->frames; i++) {
+        ST(&s, m->buttons[i]);
+        ST(&s, m->hashes[i]);
+    }
+    FILE* f = fopen(path, "wb");
+    int ok = f && fwrite(buf, 1, len, f) == len;
+    if (f && fclose(f)) ok = 0;
+    free(buf);
+    return ok ? STATE_OK : STATE_ERR_IO;
+}
+
+// reads a movie for the cartridge loaded in g
+int movie_load(movie* m, gb* g, const char* path) {
+    memset(m, 0, sizeof(*m));
+    FILE* f = fopen(path, "rb");
+    if (!f) return STATE_ERR_IO;
+    fseek(f, 0, SEEK_END);
+    long len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    u8* buf = len > 0 ? malloc(len) : NULL;
+    int ok = buf && fread(buf, 1, len, f) == (size_t)len;
+    fclose(f);
+    if (!ok) {
+        free(buf);
+        return STATE_ERR_IO;
+    }
 
-        count++;
-        if (count % 100000 == 0) {
-            handle_events(&quit, &g);
-            render_gb_display(&g);
+    state_io s = {.buf = buf, .len = len, .load = 1};
+    u32 magic = 0, start_len = 0;
+    u16 version = 0, flags = 0;
+    ST(&s, magic);
+    ST(&s, version);
+    ST(&s, flags);
+    ST(&s, m->rom);
+    ST(&s, m->frames);
+    ST(&s, start_len);
+    int status = STATE_OK;
+    if (s.err) status = STATE_ERR_SIZE;
+    else if (magic != MOVIE_MAGIC) status = STATE_ERR_FORMAT;
+    else if (version != MOVIE_VERSION) status = STATE_ERR_VERSION;
+    else if (m->rom != state_rom_id(g)) status = STATE_ERR_ROM;
+    else if (start_len > (size_t)len - MOVIE_HEADER ||
+             (size_t)len - MOVIE_HEADER - start_len !=
+                 (size_t)m->frames * MOVIE_FRAME)
+        status = STATE_ERR_SIZE;
+    if (status != STATE_OK) {
+        free(buf);
+        memset(m, 0, sizeof(*m));
+        return status;
+    }
+    m->start_len = start_len;
+    if (start_len) {
+        m->start = malloc(start_len);
+        st_bytes(&s, m->start, start_len);
+    }
+    m->cap = m->frames;
+    m->buttons = malloc(m->frames + 1);
+    m->hashes = malloc((m->frames + 1) * sizeof(u64));
+    for (u32 i = 0; i < m->frames; i++) {
+        ST(&s, m->buttons[i]);
+        ST(&s, m->hashes[i]);
+    }
+    free(buf);
+    return STATE_OK;
+}
+
+// replays the movie on g, which has just loaded the cartridge. *diverged is
+// the first frame whose hash doesn't match, m->frames if none. returns the
+// result of loading the start state
+int movie_play(movie* m, gb* g, u32* diverged) {
+    *diverged = m->frames;
+    if (m->start_len) {
+        int status = gb_load_state(g, m->start, m->start_len);
+        if (status != STATE_OK) return status;
+    }
+    for (u32 i = 0; i < m->frames; i++) {
+        gb_set_input(g, m->buttons[i]);
+        gb_run_frame(g);
+        if (gb_state_hash(g) != m->hashes[i]) {
+            *diverged = i;
+            break;
         }
-        usleep(10);
-        /*SDL_Delay(16); // Delay to control speed, roughly 60 frames per*/
     }
-    /*for (;;) {*/
-    /*    emulate_cycle(&g);*/
-    /*    usleep(10);*/
-    /*}*/
-    delwin(win);
-    endwin();
+    return STATE_OK;
+}
+
+// test roms report over the serial port and then spin on a `jr -2`
+int check_exit(gb* g) {
+    if (g->jit_diverged) return RUN_DIVERGED;
+    if (g->dbg_stop) return RUN_BREAK;
+    if (g->unimpl) return RUN_ILLEGAL;
+    if (g->stopped) return RUN_STOPPED;
+    if (strstr(g->serial, "Passed")) return RUN_PASSED;
+    if (strstr(g->serial, "Failed")) return RUN_FAILED;
+    if (r8(g, PC) == 0x18 && r8(g, PC + 1) == 0xFE) return RUN_LOOP;
+    return -1;
+}
+
+// runs frame by frame until the rom reports a result or max_cycles have been
+// emulated. exit conditions are only checked once per frame so the inner
+// loop is just the cpu
+int gb_run(gb* g, u64 max_cycles) {
+    int status = -1;
+    u64 ticks = g->cpu_ticks; // a loaded state starts part way through
+    while (status < 0 && g->cpu_ticks - ticks < max_cycles) {
+        u64 end = g->cpu_ticks + CYCLES_PER_FRAME;
+        run_until(g, end);
+        if (g->cpu_ticks >= end) g->frame_no++;
+        status = check_exit(g);
+    }
+    return status < 0 ? RUN_TIMEOUT : status;
+}
 
-    return 0;
+// runs to the end of the frame the ppu is drawing, so g->pix holds a whole
+// picture afterwards, or for a frame's worth of cycles with the lcd off.
+// returns a RUN_* status once the rom has stopped and -1 while it runs on
+int gb_run_frame(gb* g) {
+    u64 end = g->cpu_ticks + CYCLES_PER_FRAME;
+    if (REG_LCDC & LCDC_ON) {
+        end = frame_end(g);
+        if (end <= g->cpu_ticks) end += CYCLES_PER_FRAME;
+    }
+    run_until(g, end);
+    // a breakpoint stops short, the frame counts once it is finished
+    if (g->cpu_ticks >= end) g->frame_no++;
+    return check_exit(g);
+}
+
+const char* run_status_name(int status) {
+    switch (status) {
+    case RUN_PASSED: return "passed";
+    case RUN_FAILED: return "failed";
+    case RUN_LOOP: return "stopped in loop";
+    case RUN_STOPPED: return "stopped";
+    case RUN_ILLEGAL: return "illegal opcode";
+    case RUN_DIVERGED: return "jit diverged";
+    case RUN_BREAK: return "debugger stop";
+    default: return "timed out";
+    }
 }
+
+// embedding, see smallboy.h. the machine lives on the heap so the views
+// handed out below stay put for as long as it does
+
+gb* gb_create(const char* rom, int jit_mode, int* err) {
+    gb* g = malloc(sizeof(gb));
+    int status = g ? ROM_OK : ROM_ERR_READ;
+    if (g) {
+        initialize(g);
+        g->jit_mode = jit_mode;
+        status = load_rom(g, rom);
+    }
+    if (err) *err = status;
+    if (status != ROM_OK) {
+        free(g);
+        return NULL;
+    }
+    map_memory(g);
+    return g;
+}
+
+void gb_destroy(gb* g) {
+    if (!g) return;
+    unload_rom(g);
+    free(g);
+}
+
+void gb_set_render(gb* g, int on) { g->skip_render = !on; }
+
+const u8* gb_framebuffer(const gb* g) { return g->pix; }
+const u8* gb_wram(const gb* g) { return g->wram; }
+const u8* gb_hram(const gb* g) { return g->hram; }
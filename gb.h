@@ -1,12 +1,28 @@
+// internals of the core, shared by the frontends in this repo. embedders
+// use smallboy.h
+#include "smallboy.h"
 #include "typedefs.h"
 
 #define MEM_SIZE 0xFFFF
-#define DISPLAY_WIDTH 160
-#define DISPLAY_HEIGHT 144
 #define CPU_FREQ 4194304
+#define CYCLES_PER_FRAME 70224
+#define IDLE_CACHE 64
 
-// a struct holding the complete state of one gb core
+// cartridge mappers
+enum { MBC_NONE, MBC_1, MBC_3, MBC_5 };
+
+// per-opcode metadata, generated into opcodes.h from opcodes.json
 typedef struct {
+  u8 bytes;
+  u8 cycles;    // cost, or the cost of a conditional branch that is taken
+  u8 cycles_nt; // cost of a conditional branch that is not taken
+} opcode;
+
+// scheduled events
+enum { EV_PPU, EV_TIMER, EV_SERIAL, EV_DMA, EV_END, EV_COUNT };
+
+// a struct holding the complete state of one gb core
+struct gb {
   // CPU regs (96 bits)
   // Registers can be access as either 8 or 16b
   // AF Accum & Flags
@@ -41,34 +57,117 @@ typedef struct {
   };
 
   // 'cpu' mem
-  u8 *rom;         // program      0x0000-0x7fff
-  u8 eram[0x2000];  // int ram     0xa000-0xbfff
-  u8 wram[0x2000];  // work ram    0xc000-0xdfff
+  const u8 *rom;    // program      0x0000-0x7fff, mapped read-only
+  u8 eram[0x20000]; // cart ram     0xa000-0xbfff, up to 16 banks
+  u8 wram[WRAM_SIZE]; // work ram 0xc000-0xdfff
   u8 vram[0x2000]; // video ram    0x8000-0x9fff
-  u8 oam[0x1000];  // TODO: fix oam
-  u8 hram[0x100];    // i/o+high ram 0xff00-0xffff
+  u8 oam[0x100];   // sprites     0xfe00-0xfe9f (+ unusable area)
+  u8 hram[HRAM_SIZE]; // i/o+high ram 0xff00-0xffff
   u8 stopped;
+  u8 halted;
+
+  // memory map, one pointer per 256 byte page of the address space
+  const u8 *rmap[0x100];
+  u8 *wmap[0x100];
+
+  // cartridge
+  u32 rom_size;
+  u16 rom_banks;  // 16KB banks
+  u8 rom_mapped;  // rom is an mmap of the file rather than a heap copy
+  u8 batched;     // rom, blocks and jit belong to a gb_batch
+  u32 eram_size;
+  u8 mbc;
+  u8 has_rtc;
+  u16 rom_bank;   // bank at 0x4000-0x7fff (low 5 bits on mbc1)
+  u8 bank_hi;     // mbc1 upper rom / ram bank bits
+  u8 mbc1_mode;
+  u8 ram_bank;    // ram bank, or 0x08-0x0c for the mbc3 clock
+  u8 ram_enable;
+  u8 rtc[5];      // mbc3 clock: seconds, minutes, hours, day low, day high
+  u8 rtc_latched[5];
+  u8 rtc_latch;
+  u64 rtc_ticks;  // cpu_ticks the clock was last advanced at
+
+  // bytes sent over the serial link, test roms print their results here
+  char serial[1024];
+  u16 serial_len;
 
   // 'ppu'
-  u8 pix[160 * 144]; // screen: 160x144
+  // screen: 160x144, shades 0-3 after the palettes
+  u8 pix[DISPLAY_WIDTH * DISPLAY_HEIGHT];
   u8 ppu_mode;
   u8 enable_ppu;
+  u8 win_line;       // window's internal line counter
+  u8 frame_ready;    // set when the ppu finishes a frame
+  u8 skip_render;    // don't draw lines into pix, timing runs as usual
+
+  // the 384 tiles of vram decoded to one colour index per byte, tiles are
+  // redecoded on their next use after a write marks them dirty
+  u8 tiles[384][64];
+  u8 tile_dirty[384];
 
   // counters
   u32 cpu_instr;
-  u32 cpu_ticks;
-  u32 ppu_mode_clk;
+  u64 cpu_ticks;
+
+  // event scheduler, a min-heap of event types on their deadlines
+  u64 ev_when[EV_COUNT];
+  u8 ev_heap[EV_COUNT];
+  u8 ev_pos[EV_COUNT];
+  u8 ev_queued[EV_COUNT];
+  u8 ev_len;
+  u64 next_event;     // deadline of the earliest event
+  u8 run_done;        // set by EV_END to leave run_until
+
+  // idle loop analysis, cached on the host address of the loop's branch
+  const u8* idle_key[IDLE_CACHE];
+  u16 idle_cost[IDLE_CACHE]; // cycles per pass, 0 if not an idle loop
+  u8 idle_ind[IDLE_CACHE];   // indirect loads in the loop
+  u64 idle_skipped;          // cycles skipped in idle loops
+  u64 event_ticks;           // cpu_ticks events were last dispatched at
+
+  // predecoded blocks, see run_block()
+  struct block* blocks; // BLOCK_CACHE of them, NULL runs the plain interpreter
+  u8 no_blocks;         // never allocate them
+  u8 block_break;       // the running block's code may have changed
+  u32 wram_gen[0x20];   // bumped by writes into wram pages holding code
+  u16 imm;              // immediate operand of the current instruction
+
+  // x86-64 translations of hot blocks, see jit_translate()
+  u8 jit_mode;          // JIT_*, set before running
+  struct jit* jit;
+  u8 jit_diverged;      // JIT_DIFF found the translation of the block at
+  u16 jit_diverged_pc;  // jit_diverged_pc disagreeing with the interpreter
+
+  // debugger, see gb_break()/gb_watch()
+  struct debug* debug;  // NULL until a breakpoint or watchpoint is set
+  u8 dbg_stop;          // DBG_*, why the run stopped early
+  u16 dbg_addr;         // the breakpoint, or the watched address written
+
+  // timer
+  u64 div_base;       // cpu_ticks when the divider was last reset
+  u64 tima_ticks;     // cpu_ticks TIMA was last brought up to date
   u32 frame_no;
 
   // extra registers for handling register transfers
   u8 src_reg;
   u8 dst_reg;
   u8 unimpl;
-  u8 enable_int;
-  u8 disable_int;
-  u8 irq_en;
+  u8 enable_int;  // ei executed, IME goes on after the next instruction
+  u8 irq_en;      // IME
+  u8 irq_pending; // interrupts() has work to do, see irq_update()
+
+  u8 buttons;     // keys held down, BTN_*
 
-} gb;
+  // lazily evaluated flags, F is only current after flags_sync()
+  u8 lf_z;  // Z is set when this is 0
+  u8 lf_n;
+  u8 lf_hk; // how H is worked out from lf_ha/lf_hb
+  u8 lf_ha;
+  u8 lf_hb;
+  u16 lf_c; // C is bit 8
+
+};
 
 #define BC (g->regs[0])
 #define DE (g->regs[1])
@@ -92,6 +191,8 @@ typedef struct {
 #define fH (g->FH)
 
 // REGS
+// joypad
+#define REG_JOYP (g->hram[0x00])
 // serial link
 #define REG_SERIAL (g->hram[0x01])
 #define REG_SERIAL_CNTL (g->hram[0x02])
@@ -128,3 +229,61 @@ typedef struct {
 #define REG_INTE (g->hram[0xff])
 // backgroud paletter
 #define REG_BGRDPAL (g->hram[0x47])
+
+// core api, beyond what smallboy.h exports. each gb owns all of its state,
+// so any number of them can run side by side in one process. errors are
+// returned, never exit()ed on
+
+// gb.dbg_stop
+enum { DBG_NONE, DBG_BREAK, DBG_WATCH };
+
+void initialize(gb* g);
+int load_rom(gb* g, const char* filename);
+void unload_rom(gb* g);
+void map_memory(gb* g);
+
+void run_until(gb* g, u64 end);
+void jit_free(gb* g);
+void gb_break(gb* g, u16 addr, int on);
+void gb_watch(gb* g, u16 addr, int on);
+void gb_step(gb* g);
+void emulate_cycle(gb* g);
+void interrupts(gb* g);
+void sched_dispatch(gb* g);
+u64 gb_mcycles(gb* g);
+u8 r8(gb* g, u16 a);
+void flags_sync(gb* g);
+void flags_load(gb* g);
+u64 hash_bytes(u64 h, const u8* p, size_t n);
+
+// shared-rom batch: machines sharing the rom, block cache and jit, see
+// gb_batch_init()
+typedef struct {
+  gb* g;       // n machines
+  int* status; // RUN_* once a machine has stopped, -1 while it runs
+  int n;
+} gb_batch;
+
+int gb_batch_init(gb_batch* b, const char* rom, int n, u8 jit_mode);
+int gb_batch_run_frame(gb_batch* b);
+void gb_batch_free(gb_batch* b);
+
+// an input movie, see movie_begin()
+typedef struct {
+  u8* buttons;    // held in each frame
+  u64* hashes;    // gb_state_hash() after each frame
+  u32 frames;
+  u32 cap;
+  u32 rom;        // cartridge it was recorded with
+  u8* start;      // state it starts from, NULL at power on
+  size_t start_len;
+} movie;
+
+void movie_begin(movie* m, gb* g, int from_state);
+void movie_add(movie* m, gb* g, u8 buttons);
+void movie_free(movie* m);
+int movie_save(movie* m, const char* path);
+int movie_load(movie* m, gb* g, const char* path);
+int movie_play(movie* m, gb* g, u32* diverged);
+
+extern const char* const opcode_names[512];
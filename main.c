@@ -0,0 +1,744 @@
+// sdl/ncurses frontend and command line for the core in gb.c
+#define _DEFAULT_SOURCE
+#include "gb.h"
+#include "sync.h"
+#include <SDL.h>
+#include <ctype.h>
+#include <ncurses.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+SDL_Window* window = NULL;
+SDL_Renderer* renderer = NULL;
+SDL_Texture* texture = NULL;
+
+void init_SDL() {
+    if (SDL_Init(SDL_INIT_VIDEO) < 0) {
+        printf("SDL could not initialize! SDL_Error: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    window = SDL_CreateWindow("SmallBoy GB Emulator", SDL_WINDOWPOS_UNDEFINED,
+                              SDL_WINDOWPOS_UNDEFINED, DISPLAY_WIDTH * 4,
+                              DISPLAY_HEIGHT * 4, // Scaling up the window size
+                              SDL_WINDOW_SHOWN);
+    if (window == NULL) {
+        printf("Window could not be created! SDL_Error: %s\n", SDL_GetError());
+        exit(1);
+    }
+
+    renderer = SDL_CreateRenderer(
+        window, -1, SDL_RENDERER_ACCELERATED | SDL_RENDERER_PRESENTVSYNC);
+    if (renderer == NULL) {
+        printf("Renderer could not be created! SDL_Error: %s\n",
+               SDL_GetError());
+        exit(1);
+    }
+
+    texture = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_ARGB8888,
+                                SDL_TEXTUREACCESS_STREAMING, DISPLAY_WIDTH,
+                                DISPLAY_HEIGHT);
+    if (texture == NULL) {
+        printf("Texture could not be created! SDL_Error: %s\n",
+               SDL_GetError());
+        exit(1);
+    }
+}
+
+// the dmg's four shades, as argb
+const u32 shades[4] = {0xFFFFFFFF, 0xFF8BAC0F, 0xFF306230, 0xFF0F380F};
+
+// one texture upload per frame instead of a draw call per pixel
+void render_gb_display(const u8* pix) {
+    u32 argb[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+    for (int i = 0; i < DISPLAY_WIDTH * DISPLAY_HEIGHT; i++)
+        argb[i] = shades[pix[i]];
+    SDL_UpdateTexture(texture, NULL, argb, DISPLAY_WIDTH * sizeof(u32));
+    SDL_RenderClear(renderer);
+    SDL_RenderCopy(renderer, texture, NULL, NULL);
+    SDL_RenderPresent(renderer);
+}
+
+// keyboard -> joypad: arrows, z/x for a/b, enter for start, right shift or
+// backspace for select
+u8 key_button(SDL_Keycode k) {
+    switch (k) {
+    case SDLK_RIGHT: return BTN_RIGHT;
+    case SDLK_LEFT: return BTN_LEFT;
+    case SDLK_UP: return BTN_UP;
+    case SDLK_DOWN: return BTN_DOWN;
+    case SDLK_z: return BTN_A;
+    case SDLK_x: return BTN_B;
+    case SDLK_RETURN: return BTN_START;
+    case SDLK_RSHIFT:
+    case SDLK_BACKSPACE: return BTN_SELECT;
+    default: return 0;
+    }
+}
+
+// wall clock pacing: one emulated frame per tick of the gb's ~59.73hz
+// refresh, timed with the performance counter against absolute deadlines so
+// sleep overshoot never accumulates
+#define MAX_LAG 4 // frames behind before giving up on catching up
+#define REWIND_KEYFRAME 60 // frames between full states in the rewind ring
+
+typedef struct {
+    u64 freq;       // performance counter ticks per second
+    u64 frame;      // counter ticks per emulated frame
+    u64 deadline;   // when the current frame is due
+    int fast;       // fast-forward: uncapped, showing 1 in frame_skip + 1
+    int rewinding;  // stepping back a frame per tick instead of running
+    int frame_skip;
+    int skipped;    // frames not shown since the last one that was
+    int late;       // frames behind the deadline
+    // speed report, counted since report_at
+    u64 report_at;
+    u64 report_ticks;
+    u32 frames;
+    u32 dropped;
+    u32 total_dropped;
+    char status[96]; // the last report, shown as the window title
+} pacer;
+
+void pacer_init(pacer* p, gb* g) {
+    p->freq = SDL_GetPerformanceFrequency();
+    p->frame = p->freq * CYCLES_PER_FRAME / CPU_FREQ;
+    p->deadline = p->report_at = SDL_GetPerformanceCounter();
+    p->report_ticks = g->cpu_ticks;
+    snprintf(p->status, sizeof(p->status), "SmallBoy GB Emulator");
+}
+
+// whether the next frame can skip drawing: the frame skip when fast
+// forwarding, or a dropped frame when running behind
+int pacer_skip(pacer* p) {
+    if (p->fast) return p->skipped < p->frame_skip;
+    return p->late > 0 && p->skipped < MAX_LAG;
+}
+
+// books a finished frame and sleeps until the next one is due
+void pacer_wait(pacer* p, int skipped) {
+    p->frames++;
+    if (skipped) {
+        p->skipped++;
+        if (!p->fast) p->dropped++;
+    } else
+        p->skipped = 0;
+
+    u64 now = SDL_GetPerformanceCounter();
+    if (p->fast) {
+        p->deadline = now;
+        return;
+    }
+    p->deadline += p->frame;
+    if (now < p->deadline) {
+        p->late = 0;
+        SDL_Delay((p->deadline - now) * 1000 / p->freq);
+    } else {
+        p->late = (now - p->deadline) / p->frame;
+        if (p->late > MAX_LAG) { // stalled, start again from now
+            p->deadline = now;
+            p->late = 0;
+        }
+    }
+}
+
+// once a second: emulation speed against real time, frames and drops
+void pacer_report(pacer* p, gb* g) {
+    u64 now = SDL_GetPerformanceCounter();
+    if (now - p->report_at < p->freq) return;
+    double wall = (double)(now - p->report_at) / p->freq;
+    double emulated = (double)(g->cpu_ticks - p->report_ticks) / CPU_FREQ;
+    snprintf(p->status, sizeof(p->status),
+             "SmallBoy GB Emulator - %.0f%% speed, %.1f fps, %u dropped%s%s",
+             100 * emulated / wall, p->frames / wall, p->dropped,
+             p->fast ? " (fast forward)" : "", p->rewinding ? " (rewind)" : "");
+    p->total_dropped += p->dropped;
+    p->report_at = now;
+    p->report_ticks = g->cpu_ticks;
+    p->frames = p->dropped = 0;
+}
+
+// a drawn frame on its way to the presenter
+typedef struct {
+    u8 pix[DISPLAY_WIDTH * DISPLAY_HEIGHT];
+    char status[96]; // window title
+} frame;
+
+// the machine as the debugger shows it, sampled after every frame
+typedef struct {
+    u16 regs[6]; // BC DE HL AF SP PC
+    u8 code[4];  // bytes at PC
+    u8 hram[0x100];
+    u32 instr;
+    u64 ticks;
+    u32 frame_no;
+    u8 paused;
+    u8 stop;        // DBG_* that paused it
+    u16 stop_addr;
+    u32 done;       // debugger commands applied so far
+} snapshot;
+
+// messages to the emulation thread
+enum {
+    MSG_INPUT,    // arg: BTN_* held
+    MSG_FAST,     // arg: fast-forward on
+    MSG_REWIND,   // arg: rewinding
+    MSG_PAUSE,
+    MSG_CONTINUE,
+    MSG_STEP,
+    MSG_BREAK,    // arg: on, addr
+    MSG_WATCH,    // arg: on, addr
+};
+
+// the window mode runs the emulator on its own thread, which paces frames
+// and publishes the ones it draws through a triple buffer. the main thread
+// presents them and sends the input back through a queue, so a slow present
+// or a vsync wait never holds up emulation. with --debug a third thread runs
+// the ncurses debugger the same way: it reads snapshots and sends commands
+typedef struct {
+    gb* g;
+    pacer p;
+    int paused; // emulation thread only
+    u32 done;   // debugger commands applied
+    u8 buttons; // input last sent, put back after each rewind step
+    gb_rewind* rw; // NULL without rewind
+    movie* rec;    // NULL unless recording
+    frame frames[3];
+    triple tb;
+    spsc input; // presenter -> emulation thread
+    int debug;
+    snapshot snaps[3];
+    triple snap_tb;
+    spsc cmds; // debugger -> emulation thread
+    atomic_int quit;
+} frontend;
+
+// presenter side of the input: tracks the held keys, the fast-forward
+// toggle and the rewind key in *held
+void handle_events(frontend* f, msg* held) {
+    SDL_Event e;
+    while (SDL_PollEvent(&e) != 0) {
+        if (e.type == SDL_QUIT) atomic_store(&f->quit, 1);
+        // Handle key press events
+        if (e.type == SDL_KEYDOWN) {
+            switch (e.key.keysym.sym) {
+            case SDLK_ESCAPE: atomic_store(&f->quit, 1); break;
+            case SDLK_TAB: // toggles fast-forward
+                if (!e.key.repeat) held[MSG_FAST].arg = !held[MSG_FAST].arg;
+                break;
+            case SDLK_r: held[MSG_REWIND].arg = 1; break; // while held
+            default:
+                held[MSG_INPUT].arg |= key_button(e.key.keysym.sym);
+                break;
+            }
+        }
+        // Handle key up events
+        if (e.type == SDL_KEYUP) {
+            held[MSG_INPUT].arg &= ~key_button(e.key.keysym.sym);
+            if (e.key.keysym.sym == SDLK_r) held[MSG_REWIND].arg = 0;
+        }
+    }
+}
+
+// debugger ui state, owned by the debugger thread
+#define DBG_POINTS 16
+#define DBG_HZ 30
+
+typedef struct {
+    snapshot s;
+    u16 breaks[DBG_POINTS];
+    int nbreaks;
+    u16 watches[DBG_POINTS];
+    int nwatches;
+    int run_to; // temporary breakpoint, -1 if none
+    u32 sent;   // commands sent
+    int prompt; // key whose address is being typed, 0 if none
+    char addr[5];
+} dbg_ui;
+
+void dbg_send(frontend* f, dbg_ui* u, u8 kind, u8 arg, u16 addr) {
+    if (spsc_push(&f->cmds, (msg){kind, arg, addr})) u->sent++;
+    else beep();
+}
+
+// adds or removes addr from a breakpoint or watchpoint list
+void dbg_toggle(frontend* f, dbg_ui* u, u8 kind, u16* list, int* n,
+                u16 addr) {
+    for (int i = 0; i < *n; i++) {
+        if (list[i] != addr) continue;
+        list[i] = list[--*n];
+        dbg_send(f, u, kind, 0, addr);
+        return;
+    }
+    if (*n == DBG_POINTS) {
+        beep();
+        return;
+    }
+    list[(*n)++] = addr;
+    dbg_send(f, u, kind, 1, addr);
+}
+
+int dbg_has(const u16* list, int n, u16 addr) {
+    for (int i = 0; i < n; i++)
+        if (list[i] == addr) return 1;
+    return 0;
+}
+
+// the address typed at a b, w or r prompt
+void dbg_prompt_done(frontend* f, dbg_ui* u, u16 a) {
+    if (u->prompt == 'b')
+        dbg_toggle(f, u, MSG_BREAK, u->breaks, &u->nbreaks, a);
+    else if (u->prompt == 'w')
+        dbg_toggle(f, u, MSG_WATCH, u->watches, &u->nwatches, a);
+    else {
+        if (!dbg_has(u->breaks, u->nbreaks, a)) {
+            u->run_to = a;
+            dbg_send(f, u, MSG_BREAK, 1, a);
+        }
+        dbg_send(f, u, MSG_CONTINUE, 0, 0);
+    }
+}
+
+void dbg_key(frontend* f, dbg_ui* u, int k) {
+    if (u->prompt) {
+        int len = strlen(u->addr);
+        if ((k == KEY_BACKSPACE || k == 127 || k == 8) && len) {
+            u->addr[len - 1] = 0;
+        } else if (isxdigit(k) && len < 4) {
+            u->addr[len] = k;
+            u->addr[len + 1] = 0;
+        } else if (k == '\n' || k == KEY_ENTER) { // empty cancels
+            if (len) dbg_prompt_done(f, u, strtol(u->addr, NULL, 16));
+            u->prompt = 0;
+        }
+        return;
+    }
+    switch (k) {
+    case 's': dbg_send(f, u, MSG_STEP, 0, 0); break;
+    case 'c': dbg_send(f, u, MSG_CONTINUE, 0, 0); break;
+    case 'p': dbg_send(f, u, MSG_PAUSE, 0, 0); break;
+    case 'b':
+    case 'w':
+    case 'r':
+        u->prompt = k;
+        u->addr[0] = 0;
+        break;
+    case 'q': atomic_store(&f->quit, 1); break;
+    }
+}
+
+// registers, counters, why it stopped, the breakpoints and the hram dump
+void draw_debugger(dbg_ui* u) {
+    const snapshot* s = &u->s;
+    const u16* r = s->regs;
+    erase();
+    mvprintw(1, 2, "step:%08x  cycl:%08x  mcyc:%08x  frame:%u", s->instr,
+             (u32)s->ticks, (u32)(s->ticks >> 2), s->frame_no);
+    mvprintw(3, 2,
+             "A:%02X F:%02X B:%02X C:%02X D:%02X E:%02X H:%02X L:%02X "
+             "SP:%04X PC:%04X PCMEM:%02X,%02X,%02X,%02X",
+             r[3] >> 8, r[3] & 0xFF, r[0] >> 8, r[0] & 0xFF, r[1] >> 8,
+             r[1] & 0xFF, r[2] >> 8, r[2] & 0xFF, r[4], r[5], s->code[0],
+             s->code[1], s->code[2], s->code[3]);
+    u16 op = s->code[0] == 0xCB ? 0x100 | s->code[1] : s->code[0];
+    mvprintw(4, 2, "%04X  %s", r[5], opcode_names[op]);
+
+    if (!s->paused) mvprintw(6, 2, "running");
+    else if (s->stop == DBG_BREAK)
+        mvprintw(6, 2, "paused at breakpoint %04X", s->stop_addr);
+    else if (s->stop == DBG_WATCH)
+        mvprintw(6, 2, "paused after a write to %04X", s->stop_addr);
+    else mvprintw(6, 2, "paused");
+
+    mvprintw(7, 2, "break:");
+    for (int i = 0; i < u->nbreaks; i++) printw(" %04X", u->breaks[i]);
+    mvprintw(8, 2, "watch:");
+    for (int i = 0; i < u->nwatches; i++) printw(" %04X", u->watches[i]);
+
+    for (int i = 0; i < 0x100; i++) {
+        if (i % 16 == 0) mvprintw(10 + i / 16, 2, "FF%02X ", i);
+        printw(" %02x", s->hram[i]);
+    }
+    mvprintw(27, 2, "s step  c continue  p pause  b break  w watch  r run to  "
+                    "q quit");
+    if (u->prompt)
+        mvprintw(28, 2, "%s: %s_",
+                 u->prompt == 'b' ? "toggle breakpoint"
+                 : u->prompt == 'w' ? "toggle watchpoint" : "run to",
+                 u->addr);
+}
+
+// debugger thread: draws the newest snapshot DBG_HZ times a second and
+// turns keys into commands, so the emulation thread never waits on it
+void* debugger(void* arg) {
+    frontend* f = arg;
+    dbg_ui u = {.run_to = -1};
+    initscr();
+    cbreak();
+    noecho();
+    keypad(stdscr, TRUE);
+    timeout(1000 / DBG_HZ);
+    start_color();
+    init_pair(1, COLOR_GREEN, COLOR_BLACK);
+    attron(COLOR_PAIR(1));
+
+    while (!atomic_load(&f->quit)) {
+        int i = triple_take(&f->snap_tb);
+        if (i >= 0) {
+            u.s = f->snaps[i];
+            // a run-to breakpoint goes as soon as anything stops the run
+            // that was started after it was set
+            if (u.s.paused && u.s.done == u.sent && u.run_to >= 0) {
+                dbg_send(f, &u, MSG_BREAK, 0, u.run_to);
+                u.run_to = -1;
+            }
+        }
+        draw_debugger(&u);
+        refresh();
+        int k = getch(); // waits out the rest of the 1/DBG_HZ
+        if (k != ERR) dbg_key(f, &u, k);
+    }
+    endwin();
+    return NULL;
+}
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// runs without any terminal or window i/o and reports the result and speed.
+// recording runs frame by frame, the way a replay will
+int run_headless(gb* g, u64 max_cycles, movie* rec) {
+    double start = now_sec();
+    u64 ticks = g->cpu_ticks;
+    u32 instr = g->cpu_instr;
+    int status = -1;
+    if (!rec) status = gb_run(g, max_cycles);
+    while (rec && status < 0 && g->cpu_ticks - ticks < max_cycles) {
+        status = gb_run_frame(g);
+        movie_add(rec, g, g->buttons);
+    }
+    if (status < 0) status = RUN_TIMEOUT;
+
+    double wall = now_sec() - start;
+    double emulated = (double)(g->cpu_ticks - ticks) / CPU_FREQ;
+    if (g->serial_len) printf("%s\n", g->serial);
+    if (status == RUN_DIVERGED)
+        printf("jit and interpreter disagree after the block at %04X\n",
+               g->jit_diverged_pc);
+    printf("%s: %u instructions, %llu cycles, %u frames\n",
+           run_status_name(status), g->cpu_instr, (unsigned long long)g->cpu_ticks, g->frame_no);
+    printf("%.3fs wall, %.3fs emulated, %.0f instr/s, %.1fx realtime\n", wall,
+           emulated, (g->cpu_instr - instr) / wall, emulated / wall);
+    if (g->idle_skipped)
+        printf("%.1f%% of cycles skipped in idle loops\n",
+               100.0 * g->idle_skipped / (g->cpu_ticks - ticks));
+    return status;
+}
+
+// replays a movie headless, reporting the first frame that came out
+// different from the recording
+int run_replay(gb* g, const char* path) {
+    movie m;
+    int status = movie_load(&m, g, path);
+    u32 at = 0;
+    double start = now_sec();
+    u64 ticks = g->cpu_ticks;
+    if (status == STATE_OK) status = movie_play(&m, g, &at);
+    if (status != STATE_OK) {
+        fprintf(stderr, "Failed to replay: %s (%d)\n", path, status);
+        return 1;
+    }
+    double wall = now_sec() - start;
+    double emulated = (double)(g->cpu_ticks - ticks) / CPU_FREQ;
+    if (at < m.frames)
+        printf("diverged at frame %u of %u\n", at, m.frames);
+    else
+        printf("replayed %u frames, every state matches\n", m.frames);
+    printf("%.3fs wall, %.1fx realtime\n", wall, emulated / wall);
+    status = at < m.frames ? RUN_FAILED : RUN_PASSED;
+    movie_free(&m);
+    return status;
+}
+
+void publish_frame(frontend* f) {
+    frame* fr = &f->frames[f->tb.back];
+    memcpy(fr->pix, f->g->pix, sizeof(fr->pix));
+    memcpy(fr->status, f->p.status, sizeof(fr->status));
+    triple_publish(&f->tb);
+}
+
+void publish_snapshot(frontend* f) {
+    gb* g = f->g;
+    snapshot* s = &f->snaps[f->snap_tb.back];
+    flags_sync(g);
+    memcpy(s->regs, g->regs, sizeof(s->regs));
+    for (int i = 0; i < 4; i++) s->code[i] = r8(g, PC + i);
+    memcpy(s->hram, g->hram, sizeof(s->hram));
+    s->instr = g->cpu_instr;
+    s->ticks = g->cpu_ticks;
+    s->frame_no = g->frame_no;
+    s->paused = f->paused;
+    s->stop = g->dbg_stop;
+    s->stop_addr = g->dbg_addr;
+    s->done = f->done;
+    triple_publish(&f->snap_tb);
+}
+
+void command(frontend* f, msg m) {
+    gb* g = f->g;
+    switch (m.kind) {
+    case MSG_INPUT:
+        f->buttons = m.arg;
+        gb_set_input(g, m.arg);
+        break;
+    case MSG_FAST: f->p.fast = m.arg; break;
+    case MSG_REWIND: f->p.rewinding = m.arg && f->rw; break;
+    case MSG_PAUSE: f->paused = 1; break;
+    case MSG_CONTINUE:
+        f->paused = 0;
+        g->dbg_stop = DBG_NONE;
+        break;
+    case MSG_STEP:
+        f->paused = 1;
+        g->dbg_stop = DBG_NONE;
+        gb_step(g);
+        publish_frame(f);
+        break;
+    case MSG_BREAK: gb_break(g, m.addr, m.arg); break;
+    case MSG_WATCH: gb_watch(g, m.addr, m.arg); break;
+    }
+}
+
+void* emulate(void* arg) {
+    frontend* f = arg;
+    gb* g = f->g;
+    pacer* p = &f->p;
+    pacer_init(p, g);
+    while (!atomic_load(&f->quit)) {
+        msg m;
+        int cmds = 0;
+        while (spsc_pop(&f->input, &m)) command(f, m);
+        for (; spsc_pop(&f->cmds, &m); cmds++) command(f, m);
+        f->done += cmds;
+        if (f->paused) {
+            if (cmds) publish_snapshot(f);
+            SDL_Delay(1000 / DBG_HZ / 4);
+            continue;
+        }
+        if (p->rewinding) {
+            // the restored frame's input would stick until the next change
+            if (gb_rewind_step(f->rw)) {
+                gb_set_input(g, f->buttons);
+                if (f->rec && f->rec->frames) f->rec->frames--;
+            }
+            p->report_ticks = g->cpu_ticks; // no speed while going back
+            publish_frame(f);
+            if (f->debug) publish_snapshot(f);
+            pacer_wait(p, 0);
+            pacer_report(p, g);
+            continue;
+        }
+        int skip = pacer_skip(p);
+        g->skip_render = skip && !f->rec; // the screen is part of the hash
+        int status = gb_run_frame(g);
+        if (f->rec) movie_add(f->rec, g, g->buttons);
+        if (status == RUN_STOPPED || status == RUN_ILLEGAL ||
+            status == RUN_DIVERGED)
+            break;
+        if (f->rw) gb_rewind_capture(f->rw);
+        if (status == RUN_BREAK) f->paused = 1;
+        if (!skip || f->paused) publish_frame(f);
+        if (f->debug) publish_snapshot(f);
+        pacer_wait(p, skip);
+        pacer_report(p, g);
+    }
+    atomic_store(&f->quit, 1);
+    return NULL;
+}
+
+void usage(const char* name) {
+    printf("Usage: %s [--headless] [--frames N] [--cycles N] [--no-blocks] "
+           "[--jit | --jit-diff] [--load-state FILE] [--save-state FILE] "
+           "[--fast-forward] [--frame-skip N] [--rewind MB] [--debug] "
+           "[--record FILE | --replay FILE] <ROM file>\n",
+           name);
+}
+
+int main(int argc, char** argv) {
+    const char* rom_path = NULL;
+    const char* load_path = NULL;
+    const char* save_path = NULL;
+    const char* record_path = NULL;
+    const char* replay_path = NULL;
+    int headless = 0;
+    int no_blocks = 0;
+    int jit_mode = JIT_OFF;
+    int fast = 0;
+    int frame_skip = 3;
+    int debug = 0;
+    int rewind_mb = 8;
+    u64 max_cycles = (u64)CYCLES_PER_FRAME * 60 * 120; // two emulated minutes
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless") == 0) headless = 1;
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            max_cycles = strtoull(argv[++i], NULL, 0) * CYCLES_PER_FRAME;
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+            max_cycles = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--no-blocks") == 0)
+            no_blocks = 1;
+        else if (strcmp(argv[i], "--jit") == 0)
+            jit_mode = JIT_ON;
+        else if (strcmp(argv[i], "--jit-diff") == 0)
+            jit_mode = JIT_DIFF;
+        else if (strcmp(argv[i], "--fast-forward") == 0)
+            fast = 1;
+        else if (strcmp(argv[i], "--frame-skip") == 0 && i + 1 < argc)
+            frame_skip = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--rewind") == 0 && i + 1 < argc)
+            rewind_mb = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--debug") == 0)
+            debug = 1;
+        else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc)
+            load_path = argv[++i];
+        else if (strcmp(argv[i], "--save-state") == 0 && i + 1 < argc)
+            save_path = argv[++i];
+        else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+            record_path = argv[++i];
+        else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc)
+            replay_path = argv[++i];
+        else if (argv[i][0] != '-' && !rom_path) rom_path = argv[i];
+        else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // the debugger stops and steps part way through frames, which a movie
+    // can't replay
+    if (!rom_path || (record_path && (replay_path || debug))) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    gb* g = gb_create(rom_path, jit_mode, NULL);
+    if (!g) {
+        fprintf(stderr, "Failed to load ROM: %s\n", rom_path);
+        return 1;
+    }
+    g->no_blocks = no_blocks; // blocks are only allocated on the first run
+
+    if (load_path && gb_load_state_file(g, load_path) != STATE_OK) {
+        fprintf(stderr, "Failed to load state: %s\n", load_path);
+        return 1;
+    }
+
+    if (replay_path) {
+        int status = run_replay(g, replay_path);
+        gb_destroy(g);
+        return status;
+    }
+    movie rec;
+    if (record_path) movie_begin(&rec, g, load_path != NULL);
+
+    if (headless) {
+        int status = run_headless(g, max_cycles, record_path ? &rec : NULL);
+        if (save_path && gb_save_state_file(g, save_path) != STATE_OK) {
+            fprintf(stderr, "Failed to save state: %s\n", save_path);
+            status = 1;
+        }
+        if (record_path && movie_save(&rec, record_path) != STATE_OK) {
+            fprintf(stderr, "Failed to save movie: %s\n", record_path);
+            status = 1;
+        }
+        if (record_path) movie_free(&rec);
+        gb_destroy(g);
+        return status;
+    }
+
+    init_SDL();
+    char title[16];
+    memcpy(title, &g->rom[0x134], sizeof(title));
+    /*printf("title: %s\n", title);*/
+    /*printf("cartridge type: %x\n", g->rom[0x147]);*/
+    /*printf("rom size: %x\n", g->rom[0x148]);*/
+    /*printf("ram size: %x\n", g->rom[0x149]);*/
+    /*printf("header checksum: %x\n", g->rom[0x14D]);*/
+
+    uint8_t checksum = 0;
+    for (uint16_t address = 0x0134; address <= 0x014C; address++) {
+        checksum = checksum - g->rom[address] - 1;
+    }
+    /*printf("calculated header checksum: %x\n", checksum);*/
+    /*for (int i = 0; i < 16; i++) {*/
+    /*  printf("%c\n", (char)g->rom[0x134 + i]);*/
+    /*}*/
+    frontend* f = calloc(1, sizeof(frontend));
+    f->g = g;
+    f->p.fast = fast;
+    f->p.frame_skip = frame_skip;
+    f->debug = debug;
+    f->buttons = g->buttons;
+    if (record_path) f->rec = &rec;
+    if (rewind_mb > 0) {
+        f->rw = gb_rewind_new(g, (size_t)rewind_mb << 20, REWIND_KEYFRAME);
+        if (f->rw) gb_rewind_capture(f->rw);
+        else
+            fprintf(stderr, "Rewind off, %d MB is too small\n", rewind_mb);
+    }
+    triple_init(&f->tb);
+    triple_init(&f->snap_tb);
+    spsc_init(&f->input);
+    spsc_init(&f->cmds);
+    atomic_init(&f->quit, 0);
+    pthread_t emu, dbg;
+    pthread_create(&emu, NULL, emulate, f);
+    if (debug) pthread_create(&dbg, NULL, debugger, f);
+
+    msg held[3] = {{MSG_INPUT, g->buttons, 0}, {MSG_FAST, fast, 0},
+                   {MSG_REWIND, 0, 0}};
+    msg sent[3] = {held[0], held[1], held[2]};
+    char shown[96] = ""; // window title
+    while (!atomic_load(&f->quit)) {
+        handle_events(f, held);
+        // a full queue keeps the change for the next pass
+        for (int i = 0; i < 3; i++)
+            if (held[i].arg != sent[i].arg && spsc_push(&f->input, held[i]))
+                sent[i] = held[i];
+        int i = triple_take(&f->tb);
+        if (i < 0) {
+            SDL_WaitEventTimeout(NULL, 1);
+            continue;
+        }
+        render_gb_display(f->frames[i].pix);
+        if (strcmp(shown, f->frames[i].status)) {
+            memcpy(shown, f->frames[i].status, sizeof(shown));
+            SDL_SetWindowTitle(window, shown);
+        }
+    }
+    pthread_join(emu, NULL);
+    if (debug) pthread_join(dbg, NULL);
+
+    f->p.total_dropped += f->p.dropped;
+    printf("%u frames, %u dropped\n", g->frame_no, f->p.total_dropped);
+    gb_rewind_free(f->rw);
+    free(f);
+    if (record_path) {
+        if (movie_save(&rec, record_path) != STATE_OK)
+            fprintf(stderr, "Failed to save movie: %s\n", record_path);
+        else
+            printf("recorded %u frames to %s\n", rec.frames, record_path);
+        movie_free(&rec);
+    }
+    int status = g->unimpl ? RUN_ILLEGAL : g->stopped ? RUN_STOPPED : 0;
+    if (status) printf("%s at %04x\n", run_status_name(status), PC);
+    gb_destroy(g);
+    return status;
+}
@@ -0,0 +1,298 @@
+# Generate the roms make test checks: python3 make_test_roms.py testroms/bg.gb
+#
+# small programs that set up a screen and leave it running, one per video
+# feature, so golden.txt has something to check on a fresh clone. tiles, maps
+# and sprites are built here and copied into place with the lcd off. the
+# nintendo logo the boot rom checks is taken from bootrom.h
+import math
+import os
+import re
+import sys
+
+
+class Asm:
+    """machine code at org, with labels for jr/jp/call targets"""
+
+    def __init__(self, org):
+        self.org = org
+        self.b = bytearray()
+        self.labels = {}
+        self.fixups = []
+
+    def label(self, name):
+        self.labels[name] = self.org + len(self.b)
+
+    def db(self, *xs):
+        self.b += bytes(x & 0xFF for x in xs)
+
+    def jr(self, op, name):  # 0x18 always, 0x20 nz, 0x28 z
+        self.db(op, 0)
+        self.fixups.append((len(self.b) - 1, name, 1))
+
+    def jp(self, op, name):  # 0xC3 jp, 0xCD call
+        self.db(op, 0, 0)
+        self.fixups.append((len(self.b) - 2, name, 2))
+
+    def done(self):
+        for at, name, size in self.fixups:
+            to = self.labels[name]
+            if size == 1:
+                d = to - (self.org + at + 1)
+                assert -128 <= d < 128, name
+                self.b[at] = d & 0xFF
+            else:
+                self.b[at:at + 2] = bytes((to & 0xFF, to >> 8))
+        return bytes(self.b)
+
+
+DATA = 0x1000  # where the copied blocks live in the rom
+
+
+class Program:
+    """a rom whose code starts at 0150 by copying its blocks into place"""
+
+    def __init__(self):
+        self.a = Asm(0x150)
+        self.data = bytearray()
+        self.handlers = []
+        a = self.a
+        a.db(0x31, 0xFE, 0xDF)                # ld sp, dffe
+        a.label('vbl')
+        a.db(0xF0, 0x44, 0xFE, 0x90)          # ldh a, (ly); cp 144
+        a.jr(0x20, 'vbl')
+        a.db(0xAF, 0xE0, 0x40)                # xor a; ldh (lcdc), a
+
+    def copy(self, dst, data):
+        src = DATA + len(self.data)
+        self.data += data
+        n = len(data)
+        self.a.db(0x21, src & 0xFF, src >> 8,  # ld hl, src
+                  0x11, dst & 0xFF, dst >> 8,  # ld de, dst
+                  0x01, n & 0xFF, n >> 8)      # ld bc, n
+        self.a.jp(0xCD, 'copy')
+
+    def regs(self, **values):
+        """ldh writes, e.g. regs(bgp=0xE4)"""
+        for name, v in values.items():
+            self.a.db(0x3E, v, 0xE0, IO[name])  # ld a, v; ldh (reg), a
+
+    def vector(self, at, code):
+        """an interrupt handler, it must fit the 8 bytes before the next"""
+        assert len(code) <= 8
+        self.handlers.append((at, code))
+
+    def rom(self, title):
+        a = self.a
+        a.label('copy')                       # hl to de, bc bytes
+        a.db(0x2A, 0x12, 0x13)                # ld a, (hl+); ld (de), a; inc de
+        a.db(0x0B, 0x78, 0xB1)                # dec bc; ld a, b; or c
+        a.jr(0x20, 'copy')
+        a.db(0xC9)                            # ret
+        code = a.done()
+        assert 0x150 + len(code) <= DATA
+        r = bytearray(0x8000)
+        r[0x150:0x150 + len(code)] = code
+        r[DATA:DATA + len(self.data)] = self.data
+        for at, h in self.handlers:
+            r[at:at + len(h)] = h
+        r[0x100:0x104] = b'\x00\xC3\x50\x01'  # nop; jp 0150
+        r[0x104:0x134] = logo()
+        r[0x134:0x134 + len(title)] = title.upper().encode()
+        c = 0
+        for i in range(0x134, 0x14D):
+            c = (c - r[i] - 1) & 0xFF
+        r[0x14D] = c
+        return bytes(r)
+
+
+IO = {'lcdc': 0x40, 'stat': 0x41, 'scy': 0x42, 'scx': 0x43, 'bgp': 0x47,
+      'obp0': 0x48, 'obp1': 0x49, 'wy': 0x4A, 'wx': 0x4B, 'if_': 0x0F,
+      'ie': 0xFF}
+
+
+def logo():
+    path = os.path.join(os.path.dirname(os.path.abspath(__file__)),
+                        'bootrom.h')
+    with open(path) as f:
+        boot = re.findall(r'0x([0-9a-fA-F]{2})', f.read())
+    return bytes(int(x, 16) for x in boot[0xA8:0xA8 + 48])
+
+
+def tile(rows):
+    """8 strings of 8 shades 0-3 to 16 bytes of 2bpp"""
+    out = bytearray()
+    for row in rows:
+        lo = hi = 0
+        for x, c in enumerate(row):
+            lo |= (int(c) & 1) << (7 - x)
+            hi |= (int(c) >> 1) << (7 - x)
+        out += bytes((lo, hi))
+    return bytes(out)
+
+
+CHECKER = tile(['10101010', '01010101'] * 4)
+SOLID = tile(['33333333'] * 8)
+STRIPES = tile(['01230123', '12301230', '23012301', '30123012'] * 2)
+FRAME = tile(['33333333'] + ['30000003'] * 6 + ['33333333'])
+ARROW = tile(['00033000', '00333300', '03333330', '33333333',
+              '00022000', '00022000', '00011000', '00011000'])
+
+
+def oam(sprites):
+    """(x, y, tile, attr) on screen coordinates, the rest hidden"""
+    out = bytearray(160)
+    for i, (x, y, t, attr) in enumerate(sprites):
+        out[i * 4:i * 4 + 4] = bytes((y + 16, x + 8, t, attr))
+    return bytes(out)
+
+
+def halt_loop(p):
+    p.a.db(0xFB)                              # ei
+    p.a.label('idle')
+    p.a.db(0x76)                              # halt
+    p.a.jr(0x18, 'idle')
+
+
+# background, window and sprites over both, with scroll and all 3 palettes
+def bg():
+    p = Program()
+    p.copy(0x8000, bytes(16) + CHECKER + SOLID + STRIPES)
+    p.copy(0x9800, bytes((i & 1) + 1 for i in range(0x400)))
+    p.copy(0x9C00, bytes([3]) * 0x400)
+    p.copy(0xFE00, oam([(20, 20, 3, 0x00), (24, 24, 1, 0xB0)]))
+    p.regs(bgp=0xE4, obp0=0xE4, obp1=0x1B, wy=72, wx=87, scy=4, scx=3,
+           lcdc=0xF3)
+    p.a.label('end')
+    p.a.jr(0x18, 'end')
+    return p.rom('bg')
+
+
+# 8x16 sprites: flips, both palettes, behind the background, overlapping,
+# and more than the 10 a line can show
+def sprites():
+    p = Program()
+    p.copy(0x8000, bytes(16) + FRAME + ARROW + ARROW[::-1])
+    p.copy(0x9800, bytes(i % 32 >= 10 for i in range(0x400)))
+    s = []
+    for i in range(12):  # a row of 12, the last 2 aren't drawn
+        s.append((4 + i * 12, 24, 2, (i & 3) << 5))
+    for i in range(4):   # overlapping, the lower x wins
+        s.append((40 + i * 3, 60, 2, 0x10 * (i & 1)))
+    for i in range(4):   # behind background shades 1-3
+        s.append((100 + i * 14, 60, 2, 0x80))
+    s.append((20, 100, 3, 0x00))  # odd tile number, the pair starts at 2
+    s.append((60, 100, 2, 0x60))
+    p.copy(0xFE00, oam(s))
+    p.regs(bgp=0xE4, obp0=0xD2, obp1=0x27, lcdc=0x97)
+    p.a.label('end')
+    p.a.jr(0x18, 'end')
+    return p.rom('sprites')
+
+
+# scrolls one pixel a frame from the vblank interrupt and rotates the
+# palette every 32 frames, so the screen depends on counting frames right
+def scroll():
+    p = Program()
+    p.copy(0x8000, bytes(16) + CHECKER + SOLID + STRIPES)
+    p.copy(0x9800, bytes(((i ^ i >> 5) >> 1) & 3 for i in range(0x400)))
+    p.regs(bgp=0xE4, scx=0, scy=0, if_=0, ie=0x01, lcdc=0x91)
+    p.vector(0x40, bytes((0xC3, 0x00, 0x0F)))  # jp 0f00
+    h = Asm(0x0F00)
+    h.db(0xF5)                                # push af
+    h.db(0xF0, 0x43, 0x3C, 0xE0, 0x43)        # scx++
+    h.db(0xF0, 0x80, 0x3C, 0xE0, 0x80)        # frame++ at ff80
+    h.db(0xE6, 0x01)                          # and 1
+    h.jr(0x20, 'odd')
+    h.db(0xF0, 0x42, 0x3D, 0xE0, 0x42)        # scy-- every other frame
+    h.label('odd')
+    h.db(0xF0, 0x80, 0xE6, 0x1F)              # ldh a, (ff80); and 31
+    h.jr(0x20, 'out')
+    h.db(0xF0, 0x47, 0x0F, 0x0F, 0xE0, 0x47)  # bgp rotated by a shade
+    h.label('out')
+    h.db(0xF1, 0xD9)                          # pop af; reti
+    p.handlers.append((0x0F00, h.done()))
+    halt_loop(p)
+    return p.rom('scroll')
+
+
+# a wave drawn by changing scx in every hblank, from a table indexed by the
+# line and the frame
+def raster():
+    p = Program()
+    p.copy(0x8000, bytes(16) + CHECKER + SOLID + STRIPES)
+    p.copy(0x9800, bytes(((i >> 1) & 1) * 2 + 1 for i in range(0x400)))
+    wave = bytes(8 + round(7 * math.sin(i * math.pi / 16)) for i in range(32))
+    p.regs(bgp=0xE4, stat=0x08, if_=0, ie=0x03, lcdc=0x91)
+    p.vector(0x40, bytes((0xC3, 0x00, 0x0F)))  # jp 0f00
+    p.vector(0x48, bytes((0xC3, 0x20, 0x0F)))  # jp 0f20
+    v = bytes((0xF5,                          # push af
+               0xF0, 0x80, 0x3C, 0xE0, 0x80,  # frame++ at ff80
+               0xF1, 0xD9))                   # pop af; reti
+    h = bytes((0xF5, 0xE5,                    # push af; push hl
+               0xF0, 0x80, 0x6F,              # ldh a, (ff80); ld l, a
+               0xF0, 0x44, 0x85,              # ldh a, (ly); add l
+               0xE6, 0x1F, 0x6F,              # and 31; ld l, a
+               0x26, 0x0E,                    # ld h, 0e
+               0x7E, 0xE0, 0x43,              # ld a, (hl); ldh (scx), a
+               0xE1, 0xF1, 0xD9))             # pop hl; pop af; reti
+    p.handlers += [(0x0F00, v), (0x0F20, h), (0x0E00, wave)]
+    halt_loop(p)
+    return p.rom('raster')
+
+
+# a hot loop over every op class the jit emits inline, each block short
+# enough to fit between two ppu events so it runs translated. the registers
+# and flags are stored into the tile on screen after every frame's loop, so
+# a wrong result changes the picture, and make test also runs it with
+# --jit-diff
+def jit():
+    p = Program()
+    p.copy(0x9800, bytes([1]) * 0x400)
+    p.regs(bgp=0xE4, lcdc=0x91)
+    a = p.a
+    a.label('frame')
+    a.db(0x3E, 64, 0xE0, 0x81)                # 64 loops, counted at ff81
+    a.label('loop')
+    a.db(0x00, 0x41, 0x50)                    # nop; ld b, c; ld d, b
+    a.db(0x1E, 0x37, 0x3E, 0x5A)              # ld e, 37; ld a, 5a
+    a.db(0x80, 0x8B, 0x92, 0x99)              # add b; adc e; sub d; sbc c
+    a.jp(0xC3, 'alu')
+    a.label('alu')
+    a.db(0xA3, 0xA8, 0xB2, 0xB9)              # and e; xor b; or d; cp c
+    a.db(0xC6, 0x11, 0xD6, 0x22, 0xE6, 0xF7)  # add 11; sub 22; and f7
+    a.db(0xEE, 0x3C, 0xF6, 0x81, 0xFE, 0x40)  # xor 3c; or 81; cp 40
+    a.db(0xCE, 0x03, 0xDE, 0x01)              # adc 03; sbc 01
+    a.jp(0xC3, 'incdec')
+    a.label('incdec')
+    a.db(0x3C, 0x04, 0x15, 0x1C, 0x1D)        # inc a; inc b; dec d; inc e; dec e
+    a.db(0x24, 0x2D, 0x0C, 0x67, 0x68)        # inc h; dec l; inc c; ld h, a; ld l, b
+    a.jp(0xC3, 'wide')
+    a.label('wide')
+    a.db(0x01, 0x34, 0x12, 0x11, 0x78, 0x56)  # ld bc, 1234; ld de, 5678
+    a.db(0x21, 0xBC, 0x9A, 0x31, 0xF0, 0xDF)  # ld hl, 9abc; ld sp, dff0
+    a.db(0x03, 0x13, 0x23, 0x33)              # inc bc; inc de; inc hl; inc sp
+    a.db(0x0B, 0x1B, 0x2B, 0x3B, 0x33)        # dec bc; de; hl; sp; inc sp
+    a.jp(0xC3, 'store')
+    a.label('store')
+    a.db(0x08, 0x00, 0xC0)                    # ld (c000), sp
+    a.db(0x31, 0xFE, 0xDF)                    # ld sp, dffe
+    a.db(0x84, 0xAD, 0x82, 0xB3)              # add h; xor l; add d; or e
+    a.db(0x21, 0x81, 0xFF, 0x35)              # ld hl, ff81; dec (hl)
+    a.jp(0xC2, 'loop')                        # jp nz
+    for i, r in enumerate((0x7F, 0x78, 0x79, 0x7A, 0x7B)):  # a b c d e
+        a.db(r, 0xEA, 0x10 + i, 0x80)         # ld a, r; ld (8010+i), a
+    a.db(0xFA, 0x00, 0xC0, 0xEA, 0x15, 0x80)  # sp as stored
+    a.db(0xFA, 0x01, 0xC0, 0xEA, 0x16, 0x80)
+    a.db(0xF5, 0xE1, 0x7D, 0xEA, 0x17, 0x80)  # f, via push af; pop hl
+    a.jp(0xC3, 'frame')
+    return p.rom('jit')
+
+
+ROMS = {'bg': bg, 'sprites': sprites, 'scroll': scroll, 'raster': raster,
+        'jit': jit}
+
+if __name__ == '__main__':
+    for path in sys.argv[1:]:
+        name = os.path.splitext(os.path.basename(path))[0]
+        with open(path, 'wb') as f:
+            f.write(ROMS[name]())
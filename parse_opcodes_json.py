@@ -1,30 +1,41 @@
-# Parse opcodes from opcodes.json to csv
+# Generate opcodes.h from opcodes.json: python3 parse_opcodes_json.py > opcodes.h
+#
+# opcs[] holds the numeric fields the cpu loop reads every instruction, packed
+# into 3 bytes per opcode so the whole table is 1.5KB. the mnemonics are only
+# used by the debugger and live in a separate opcode_names[] array.
+# entries 0x000-0x0ff are the unprefixed opcodes, 0x100-0x1ff the CB ones.
 import json
+import sys
 
-with open('opcodes.json') as f:
+path = sys.argv[1] if len(sys.argv) > 1 else 'opcodes.json'
+with open(path) as f:
     data = json.load(f)
 
-for d in list(data.keys()):
-    # print(d)
-
+entries = []
+names = []
+for d in ('unprefixed', 'cbprefixed'):
     unp = data[d]
-    for opc in list(unp.keys()):
-        # print(opc)
-        if d == 'unprefixed':
-            nm = ''
-        else:
-            nm = 'CB '
-        opcd = unp[opc]
+    for n in range(256):
+        opcd = unp['0x%02X' % n]
+        nm = 'CB ' if d == 'cbprefixed' else ''
         nm += opcd['mnemonic']
-        bytez = opcd['bytes']
-        cyc = opcd['cycles'][0]
-        fZ = opcd['flags']['Z']
-        fN = opcd['flags']['N']
-        fH = opcd['flags']['H']
-        fC = opcd['flags']['C']
         for operand in opcd['operands']:
             nm += ' ' + operand['name']
 
-        f = open('opcodes.csv', 'a')
-        f.write("{},{},{},{},{},{},{},{}\n".format(opc,nm, bytez,cyc,fZ,fN,fH,fC))
-        f.close()
+        # conditional jumps, calls and returns list the taken cost first
+        cyc = opcd['cycles']
+        taken = cyc[0]
+        not_taken = cyc[1] if len(cyc) > 1 else cyc[0]
+
+        entries.append('    {%d, %d, %d}, // %s' %
+                       (opcd['bytes'], taken, not_taken, nm))
+        names.append('    "%s",' % nm)
+
+out = sys.stdout
+out.write('// generated from %s by parse_opcodes_json.py, do not edit\n\n' % path)
+out.write('const opcode opcs[512] = {\n')
+out.write('\n'.join(entries))
+out.write('\n};\n\n')
+out.write('const char* const opcode_names[512] = {\n')
+out.write('\n'.join(names))
+out.write('\n};\n')
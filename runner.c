@@ -0,0 +1,556 @@
+// regression runner: runs a set of roms headless on a pool of worker
+// threads, one core per job (or a batch of them, --batch), and reports each
+// result with its timing. with --golden it checks the screens of a manifest
+// of roms instead
+#define _DEFAULT_SOURCE
+#include "gb.h"
+#include <dirent.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+typedef struct {
+    char* path;
+    int status; // RUN_* once run, ROM_ERR_* if the rom didn't load
+    u32 instr;
+    u64 ticks;
+    u32 frames;
+    int passed; // machines that passed
+    double wall;
+    u32 run_frames; // golden: frames to run
+    u64 want;       // golden: expected screen hash, 0 if not known yet
+    u64 got;
+    u8 state_bad;   // golden --round-trip: a reloaded run ended elsewhere
+} job;
+
+// jobs are handed out in order from a shared counter
+typedef struct {
+    job* jobs;
+    int njobs;
+    int next;
+    u64 max_cycles;
+    u8 jit_mode;
+    int batch; // machines per job
+    int golden;
+    int update;      // golden: rewrite the manifest with the hashes found
+    int round_trip;  // golden: rerun the second half from a state and rewind
+    const char* out; // golden: where pngs go
+    pthread_mutex_t lock;
+} pool;
+
+double now_sec() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+void run_job(gb* g, job* j, u64 max_cycles, u8 jit_mode) {
+    double start = now_sec();
+    initialize(g);
+    g->jit_mode = jit_mode;
+    j->status = load_rom(g, j->path);
+    if (j->status == ROM_OK) {
+        map_memory(g);
+        j->status = gb_run(g, max_cycles);
+        j->instr = g->cpu_instr;
+        j->ticks = g->cpu_ticks;
+        j->frames = g->frame_no;
+        j->passed = j->status == RUN_PASSED;
+        unload_rom(g);
+    }
+    j->wall = now_sec() - start;
+}
+
+// a shared-rom batch of n machines, see gb_batch_init(), run until all of
+// them have stopped or max_cycles are up. the job passes if every machine
+// did, the counts are summed over the machines
+void run_batch(job* j, int n, u64 max_cycles, u8 jit_mode) {
+    double start = now_sec();
+    gb_batch b;
+    j->status = gb_batch_init(&b, j->path, n, jit_mode);
+    if (j->status == ROM_OK) {
+        for (u64 f = 0; f * CYCLES_PER_FRAME < max_cycles; f++)
+            if (!gb_batch_run_frame(&b)) break;
+        j->status = RUN_PASSED;
+        for (int i = 0; i < n; i++) {
+            int st = b.status[i] < 0 ? RUN_TIMEOUT : b.status[i];
+            if (st != RUN_PASSED && j->status == RUN_PASSED) j->status = st;
+            j->passed += st == RUN_PASSED;
+            j->instr += b.g[i].cpu_instr;
+            j->ticks += b.g[i].cpu_ticks;
+            j->frames += b.g[i].frame_no;
+        }
+        gb_batch_free(&b);
+    }
+    j->wall = now_sec() - start;
+}
+
+// png output, just enough for screenshots: 8-bit rgb in uncompressed
+// deflate blocks. png_read() only reads what png_write() wrote
+void put_be32(u8* p, u32 v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+u32 get_be32(const u8* p) {
+    return (u32)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+u32 png_crc(const u8* p, size_t n) {
+    u32 c = ~0u;
+    while (n--) {
+        c ^= *p++;
+        for (int k = 0; k < 8; k++) c = c >> 1 ^ (0xEDB88320 & -(c & 1));
+    }
+    return ~c;
+}
+
+// w x h pixels of rgb, row by row
+int png_write(const char* path, const u8* rgb, int w, int h) {
+    size_t row = (size_t)w * 3, raw = (row + 1) * h;
+    size_t blocks = (raw + 0xFFFE) / 0xFFFF;
+    size_t zlen = 2 + blocks * 5 + raw + 4;
+    size_t len = 8 + 25 + 12 + zlen + 12;
+    u8* buf = malloc(len);
+    if (!buf) return -1;
+    u8* o = buf;
+    memcpy(o, "\x89PNG\r\n\x1a\n", 8);
+    o += 8;
+    put_be32(o, 13);
+    memcpy(o + 4, "IHDR", 4);
+    put_be32(o + 8, w);
+    put_be32(o + 12, h);
+    memcpy(o + 16, "\x08\x02\x00\x00\x00", 5); // 8-bit rgb
+    put_be32(o + 21, png_crc(o + 4, 17));
+    o += 25;
+
+    u8* idat = o;
+    put_be32(o, zlen);
+    memcpy(o + 4, "IDAT", 4);
+    o += 8;
+    *o++ = 0x78; // zlib, 32KB window, no compression
+    *o++ = 0x01;
+    u32 a = 1, b = 0; // adler32
+    size_t left = raw;
+    for (int y = 0, x = -1; left;) {
+        size_t n = left < 0xFFFF ? left : 0xFFFF;
+        left -= n;
+        *o++ = !left;
+        *o++ = n;
+        *o++ = n >> 8;
+        *o++ = ~n;
+        *o++ = ~n >> 8;
+        while (n--) {
+            // every row starts with filter type 0
+            u8 v = x < 0 ? 0 : rgb[y * row + x];
+            if (++x == (int)row) x = -1, y++;
+            *o++ = v;
+            a = (a + v) % 65521;
+            b = (b + a) % 65521;
+        }
+    }
+    put_be32(o, b << 16 | a);
+    o += 4;
+    put_be32(o, png_crc(idat + 4, o - idat - 4));
+    o += 4;
+    memcpy(o, "\0\0\0\0IEND\xae\x42\x60\x82", 12);
+
+    FILE* f = fopen(path, "wb");
+    int ok = f && fwrite(buf, 1, len, f) == len;
+    if (f && fclose(f)) ok = 0;
+    free(buf);
+    return ok ? 0 : -1;
+}
+
+// reads a w x h image written by png_write() into rgb
+int png_read(const char* path, u8* rgb, int w, int h) {
+    FILE* f = fopen(path, "rb");
+    if (!f) return -1;
+    u8 buf[65536 + 8];
+    size_t row = (size_t)w * 3, raw = (row + 1) * h, o = 0;
+    int ok = fread(buf, 1, 33, f) == 33 && !memcmp(buf + 12, "IHDR", 4) &&
+             get_be32(buf + 16) == (u32)w && get_be32(buf + 20) == (u32)h &&
+             !memcmp(buf + 24, "\x08\x02\x00\x00\x00", 5) &&
+             fread(buf, 1, 8, f) == 8 && !memcmp(buf + 4, "IDAT", 4) &&
+             fread(buf, 1, 2, f) == 2;
+    for (int last = 0; ok && !last;) {
+        ok = fread(buf, 1, 5, f) == 5 && !(buf[0] & 6); // stored blocks
+        size_t n = buf[1] | buf[2] << 8;
+        last = buf[0] & 1;
+        ok = ok && fread(buf, 1, n, f) == n;
+        for (size_t i = 0; ok && i < n; i++, o++) {
+            size_t x = o % (row + 1);
+            if (o >= raw || (x == 0 && buf[i])) ok = 0;
+            else if (x) rgb[o / (row + 1) * row + x - 1] = buf[i];
+        }
+    }
+    fclose(f);
+    return ok && o == raw ? 0 : -1;
+}
+
+// the dmg's four shades, as rgb
+const u8 shade_rgb[4][3] = {
+    {0xFF, 0xFF, 0xFF}, {0x8B, 0xAC, 0x0F}, {0x30, 0x62, 0x30}, {0x0F, 0x38, 0x0F}};
+
+// golden frames. each manifest line is `rom frames hash`: the hash of the
+// screen after running the rom for that many frames from power on. a case
+// that comes out different writes its screen to out/<rom>.png, next to the
+// golden screen and the pixels that differ when --update has left a golden
+// png there. passing cases write nothing
+void golden_png(pool* p, job* j, const char* suffix, char* path, size_t n) {
+    snprintf(path, n, "%s/", p->out);
+    size_t at = strlen(path);
+    snprintf(path + at, n - at, "%s%s", j->path, suffix);
+    for (char* c = path + at; *c; c++)
+        if (*c == '/') *c = '_';
+}
+
+void golden_write(pool* p, job* j, const u8* pix) {
+    const int sw = DISPLAY_WIDTH, sh = DISPLAY_HEIGHT;
+    static const u8 red[3] = {0xFF, 0x00, 0x00};
+    char path[4096];
+    u8* rgb = malloc(sw * sh * 3 * 3); // golden | actual | difference
+    u8* golden = malloc(sw * sh * 3);
+    golden_png(p, j, ".golden.png", path, sizeof(path));
+    int have = !p->update && png_read(path, golden, sw, sh) == 0;
+    int w = have ? sw * 3 : sw;
+    for (int y = 0; y < sh; y++) {
+        for (int x = 0; x < sw; x++) {
+            const u8* now = shade_rgb[pix[y * sw + x] & 3];
+            u8* o = &rgb[(y * w + x) * 3];
+            if (!have) {
+                memcpy(o, now, 3);
+                continue;
+            }
+            const u8* was = &golden[(y * sw + x) * 3];
+            memcpy(o, was, 3);
+            memcpy(o + sw * 3, now, 3);
+            memcpy(o + sw * 6, memcmp(was, now, 3) ? red : now, 3);
+        }
+    }
+    if (!p->update) golden_png(p, j, ".png", path, sizeof(path));
+    if (png_write(path, rgb, w, sh) < 0)
+        fprintf(stderr, "Failed to write %s\n", path);
+    free(golden);
+    free(rgb);
+}
+
+// --round-trip: halfway through a golden run the state is saved and the
+// rewind ring starts capturing. after the straight run, the second half is
+// run again from the oldest rewind frame and then from the saved state, and
+// both have to end in exactly the same state and screen
+#define ROUND_TRIP_REWIND 90 // frames captured, over a keyframe boundary
+
+typedef struct {
+    u8* state;
+    size_t len;
+    u64 mid; // state hash halfway
+    gb_rewind* rw;
+} round_trip;
+
+void round_trip_begin(gb* g, round_trip* rt) {
+    size_t cap = gb_state_bound(g);
+    rt->state = malloc(cap);
+    rt->len = rt->state ? gb_save_state(g, rt->state, cap, STATE_RLE) : 0;
+    rt->mid = gb_state_hash(g);
+    rt->rw = gb_rewind_new(g, 4 << 20, 60);
+}
+
+// reruns the second half of the case both ways, 1 if they match the run
+int round_trip_check(gb* g, job* j, round_trip* rt, u32 frames) {
+    u64 end = gb_state_hash(g);
+    int ok = rt->len && rt->rw;
+    for (int from_state = 0; ok && from_state < 2; from_state++) {
+        if (from_state) {
+            ok = gb_load_state(g, rt->state, rt->len) == STATE_OK;
+        } else {
+            while (gb_rewind_step(rt->rw)) {
+            }
+        }
+        ok = ok && gb_state_hash(g) == rt->mid;
+        for (u32 f = 0; ok && f < frames; f++) gb_run_frame(g);
+        ok = ok && gb_state_hash(g) == end &&
+             hash_bytes(0, g->pix, sizeof(g->pix)) == j->got;
+    }
+    return ok;
+}
+
+void run_golden(gb* g, job* j, pool* p) {
+    double start = now_sec();
+    initialize(g);
+    g->jit_mode = p->jit_mode;
+    j->status = load_rom(g, j->path);
+    if (j->status == ROM_OK) {
+        map_memory(g);
+        round_trip rt = {0};
+        u32 half = p->round_trip ? j->run_frames / 2 : j->run_frames;
+        // a fixed number of frames whatever the rom reports, unless the jit
+        // went wrong
+        for (u32 f = 0; f < j->run_frames; f++) {
+            if (f == half) round_trip_begin(g, &rt);
+            if (rt.rw && gb_rewind_frames(rt.rw) < ROUND_TRIP_REWIND)
+                gb_rewind_capture(rt.rw);
+            if (gb_run_frame(g) == RUN_DIVERGED) break;
+        }
+        j->got = hash_bytes(0, g->pix, sizeof(g->pix));
+        if (half < j->run_frames && !g->jit_diverged)
+            j->state_bad = !round_trip_check(g, j, &rt, j->run_frames - half);
+        gb_rewind_free(rt.rw);
+        free(rt.state);
+        j->instr = g->cpu_instr;
+        j->ticks = g->cpu_ticks;
+        j->frames = g->frame_no;
+        j->status = p->update || j->got == j->want ? RUN_PASSED : RUN_FAILED;
+        if (j->state_bad) j->status = RUN_FAILED;
+        if (g->jit_diverged) j->status = RUN_DIVERGED;
+        if (j->status != RUN_PASSED || p->update) {
+            golden_write(p, j, g->pix);
+        } else { // the screen of an earlier failure is out of date
+            char path[4096];
+            golden_png(p, j, ".png", path, sizeof(path));
+            remove(path);
+        }
+        unload_rom(g);
+    }
+    j->wall = now_sec() - start;
+}
+
+void* worker(void* arg) {
+    pool* p = arg;
+    gb* g = malloc(sizeof(gb)); // reused for every job this thread runs
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        int i = p->next++;
+        pthread_mutex_unlock(&p->lock);
+        if (i >= p->njobs) break;
+        if (p->golden)
+            run_golden(g, &p->jobs[i], p);
+        else if (p->batch > 1)
+            run_batch(&p->jobs[i], p->batch, p->max_cycles, p->jit_mode);
+        else
+            run_job(g, &p->jobs[i], p->max_cycles, p->jit_mode);
+    }
+    free(g);
+    return NULL;
+}
+
+void add_job(pool* p, const char* path) {
+    for (int i = 0; p->golden && i < p->njobs; i++)
+        if (strcmp(p->jobs[i].path, path) == 0) return; // already listed
+    p->jobs = realloc(p->jobs, (p->njobs + 1) * sizeof(job));
+    memset(&p->jobs[p->njobs], 0, sizeof(job));
+    p->jobs[p->njobs++].path = strdup(path);
+}
+
+int has_rom_ext(const char* name) {
+    const char* ext = strrchr(name, '.');
+    return ext && (strcmp(ext, ".gb") == 0 || strcmp(ext, ".gbc") == 0);
+}
+
+int cmp_job(const void* a, const void* b) {
+    return strcmp(((const job*)a)->path, ((const job*)b)->path);
+}
+
+// adds a rom, or every rom in a directory
+int add_path(pool* p, const char* path) {
+    struct stat st;
+    if (stat(path, &st) < 0) return -1;
+    if (!S_ISDIR(st.st_mode)) {
+        add_job(p, path);
+        return 0;
+    }
+    DIR* dir = opendir(path);
+    if (!dir) return -1;
+    int first = p->njobs;
+    struct dirent* e;
+    char buf[4096];
+    while ((e = readdir(dir))) {
+        if (!has_rom_ext(e->d_name)) continue;
+        snprintf(buf, sizeof(buf), "%s/%s", path, e->d_name);
+        add_job(p, buf);
+    }
+    closedir(dir);
+    qsort(&p->jobs[first], p->njobs - first, sizeof(job), cmp_job);
+    return 0;
+}
+
+// reads the cases of a golden manifest, blank lines and # comments aside
+int read_manifest(pool* p, const char* path) {
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    char line[4096], rom[4096];
+    unsigned frames;
+    unsigned long long hash;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#' ||
+            sscanf(line, "%4095s %u %llx", rom, &frames, &hash) != 3)
+            continue;
+        add_job(p, rom);
+        p->jobs[p->njobs - 1].run_frames = frames;
+        p->jobs[p->njobs - 1].want = hash;
+    }
+    fclose(f);
+    return 0;
+}
+
+int write_manifest(pool* p, const char* path) {
+    FILE* f = fopen(path, "w");
+    if (!f) return -1;
+    fprintf(f, "# golden screens: rom, frames run from power on, hash of the "
+               "screen after them.\n# checked by make test, rewritten by "
+               "make golden-update, see README.md\n");
+    for (int i = 0; i < p->njobs; i++) {
+        job* j = &p->jobs[i];
+        u64 hash = j->status == RUN_DIVERGED ? j->want : j->got;
+        if (j->status >= 0)
+            fprintf(f, "%s %u %016llx\n", j->path, j->run_frames,
+                    (unsigned long long)hash);
+    }
+    return fclose(f) ? -1 : 0;
+}
+
+// golden results, 0 if every screen matched
+int report_golden(pool* p, double wall, int threads) {
+    int matched = 0;
+    for (int i = 0; i < p->njobs; i++) {
+        job* j = &p->jobs[i];
+        if (j->status < 0) {
+            printf("%-48s failed to load\n", j->path);
+            continue;
+        }
+        const char* result = j->status == RUN_PASSED ? "ok" : "MISMATCH";
+        if (p->update) result = j->got == j->want ? "ok" : "updated";
+        if (j->status == RUN_DIVERGED) result = "DIVERGED";
+        if (j->state_bad) result = "STATE";
+        printf("%-48s %-8s %016llx %6u frames %8.3fs\n", j->path, result,
+               (unsigned long long)j->got, j->run_frames, j->wall);
+        matched += j->status == RUN_PASSED;
+    }
+    printf("%d/%d screens match, %.3fs wall on %d threads\n", matched,
+           p->njobs, wall, threads);
+    if (matched < p->njobs && !p->update)
+        printf("screens of the failing cases are in %s\n", p->out);
+    return matched == p->njobs ? 0 : 1;
+}
+
+void usage(const char* name) {
+    printf("Usage: %s [-j N] [--frames N] [--cycles N] [--jit | --jit-diff] "
+           "[--batch N] <ROM file or dir>...\n"
+           "       %s --golden MANIFEST [--update] [--out DIR] [-j N] "
+           "[--frames N] [--jit] [--round-trip] [<ROM file or dir>...]\n",
+           name, name);
+}
+
+int main(int argc, char** argv) {
+    pool p = {.max_cycles = (u64)CYCLES_PER_FRAME * 60 * 120,
+              .out = "golden-out"};
+    pthread_mutex_init(&p.lock, NULL);
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* manifest = NULL;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0 && i + 1 < argc)
+            threads = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc)
+            p.max_cycles = strtoull(argv[++i], NULL, 0) * CYCLES_PER_FRAME;
+        else if (strcmp(argv[i], "--cycles") == 0 && i + 1 < argc)
+            p.max_cycles = strtoull(argv[++i], NULL, 0);
+        else if (strcmp(argv[i], "--jit") == 0)
+            p.jit_mode = JIT_ON;
+        else if (strcmp(argv[i], "--jit-diff") == 0)
+            p.jit_mode = JIT_DIFF;
+        else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+            p.batch = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--golden") == 0 && i + 1 < argc) {
+            manifest = argv[++i];
+            p.golden = 1;
+            if (read_manifest(&p, manifest) < 0 && errno != ENOENT) {
+                fprintf(stderr, "Failed to read: %s\n", manifest);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--update") == 0)
+            p.update = 1;
+        else if (strcmp(argv[i], "--round-trip") == 0)
+            p.round_trip = 1;
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc)
+            p.out = argv[++i];
+        else if (argv[i][0] != '-') {
+            if (add_path(&p, argv[i]) < 0) {
+                fprintf(stderr, "Failed to open: %s\n", argv[i]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+    // new golden cases run for --frames, or the same two minutes
+    int listed = 0;
+    for (int i = 0; i < p.njobs; i++) {
+        listed += p.jobs[i].run_frames != 0;
+        if (!p.jobs[i].run_frames)
+            p.jobs[i].run_frames = p.max_cycles / CYCLES_PER_FRAME;
+    }
+    if (p.golden && !p.njobs) { // nothing to check isn't a failure
+        printf("%s lists no roms, add some with --update\n", manifest);
+        return 0;
+    }
+    if (!p.njobs || (p.golden && listed < p.njobs && !p.update)) {
+        usage(argv[0]);
+        return 1;
+    }
+    if (p.golden) mkdir(p.out, 0755);
+    if (threads < 1) threads = 1;
+    if (threads > p.njobs) threads = p.njobs;
+
+    double start = now_sec();
+    pthread_t* tids = malloc(threads * sizeof(pthread_t));
+    for (int i = 0; i < threads; i++)
+        pthread_create(&tids[i], NULL, worker, &p);
+    for (int i = 0; i < threads; i++) pthread_join(tids[i], NULL);
+    double wall = now_sec() - start;
+
+    if (p.golden) {
+        int status = report_golden(&p, wall, threads);
+        if (p.update && write_manifest(&p, manifest) < 0) {
+            fprintf(stderr, "Failed to write: %s\n", manifest);
+            status = 1;
+        }
+        for (int i = 0; i < p.njobs; i++) free(p.jobs[i].path);
+        free(p.jobs);
+        free(tids);
+        return status;
+    }
+
+    int passed = 0;
+    u64 frames = 0;
+    for (int i = 0; i < p.njobs; i++) {
+        job* j = &p.jobs[i];
+        if (j->status < 0) {
+            printf("%-48s failed to load\n", j->path);
+            continue;
+        }
+        double emulated = (double)j->ticks / CPU_FREQ;
+        printf("%-48s %-16s %8.3fs %8.1fx realtime %9.0f frames/s", j->path,
+               run_status_name(j->status), j->wall, emulated / j->wall,
+               j->frames / j->wall);
+        if (p.batch > 1) printf(" %d/%d machines passed", j->passed, p.batch);
+        printf("\n");
+        passed += j->status == RUN_PASSED;
+        frames += j->frames;
+    }
+    printf("%d/%d passed, %.3fs wall on %d threads, %.0f frames/s\n", passed,
+           p.njobs, wall, threads, frames / wall);
+
+    for (int i = 0; i < p.njobs; i++) free(p.jobs[i].path);
+    free(p.jobs);
+    free(tids);
+    return passed == p.njobs ? 0 : 1;
+}
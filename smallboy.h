@@ -0,0 +1,122 @@
+// smallboy: the public interface for embedding the emulator core. a machine
+// is an opaque gb* from gb_create(), nothing here depends on its layout, so
+// programs built against this header keep working across versions of
+// libsmallboy.so. link the shared library, or libsmallboy.a for a static
+// build
+#ifndef SMALLBOY_H
+#define SMALLBOY_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(__GNUC__)
+#define GB_API __attribute__((visibility("default")))
+#else
+#define GB_API
+#endif
+
+#define DISPLAY_WIDTH 160
+#define DISPLAY_HEIGHT 144
+#define WRAM_SIZE 0x2000 // gb_wram(), 0xc000-0xdfff
+#define HRAM_SIZE 0x100  // gb_hram(), i/o registers and high ram 0xff00-0xffff
+
+typedef struct gb gb;
+
+// gb_create() errors
+enum { ROM_OK = 0, ROM_ERR_OPEN = -1, ROM_ERR_READ = -2, ROM_ERR_CART = -3 };
+
+// result of gb_run() and gb_run_frame(), also the exit status of a headless
+// run
+enum {
+  RUN_PASSED = 0,
+  RUN_FAILED = 1,
+  RUN_TIMEOUT = 2,
+  RUN_LOOP = 3,
+  RUN_STOPPED = 4, // executed stop
+  RUN_ILLEGAL = 5, // hit an illegal opcode
+  RUN_DIVERGED = 6, // the jit disagreed with the interpreter, see JIT_DIFF
+  RUN_BREAK = 7,    // hit a breakpoint or watchpoint
+};
+
+// gb_create() jit modes
+enum {
+  JIT_OFF,  // run blocks in C
+  JIT_ON,   // translate hot blocks to x86-64, off on other hosts
+  JIT_DIFF, // JIT_ON, checking every translated block against a copy of
+            // the machine running the interpreter
+};
+
+// gb_set_input() keys
+enum {
+  BTN_RIGHT = 0x01,
+  BTN_LEFT = 0x02,
+  BTN_UP = 0x04,
+  BTN_DOWN = 0x08,
+  BTN_A = 0x10,
+  BTN_B = 0x20,
+  BTN_SELECT = 0x40,
+  BTN_START = 0x80,
+};
+
+// gb_save_state()/gb_load_state() results and flags
+enum {
+  STATE_OK = 0,
+  STATE_ERR_SIZE = -1,    // buffer too small or truncated state
+  STATE_ERR_FORMAT = -2,  // not a state, or a corrupt body
+  STATE_ERR_VERSION = -3, // written by an incompatible version
+  STATE_ERR_ROM = -4,     // saved with a different cartridge
+  STATE_ERR_IO = -5,
+};
+#define STATE_RLE 0x01 // body is run length encoded
+
+// a machine with the rom loaded, ready to run from the boot rom. NULL on
+// failure with a ROM_ERR_* in *err, if err isn't NULL
+GB_API gb* gb_create(const char* rom, int jit_mode, int* err);
+GB_API void gb_destroy(gb* g);
+
+// gb_run_frame() returns -1 while the rom runs on, a RUN_* once it stopped
+GB_API int gb_run(gb* g, uint64_t max_cycles);
+GB_API int gb_run_frame(gb* g);
+GB_API const char* run_status_name(int status);
+
+// buttons is a mask of BTN_* held down until the next call
+GB_API void gb_set_input(gb* g, uint8_t buttons);
+// on by default, a machine that isn't drawn runs a little faster
+GB_API void gb_set_render(gb* g, int on);
+
+// views of the machine's own memory, valid until gb_destroy(). the screen is
+// DISPLAY_WIDTH x DISPLAY_HEIGHT shades 0-3 row by row, whole after each
+// gb_run_frame()
+GB_API const uint8_t* gb_framebuffer(const gb* g);
+GB_API const uint8_t* gb_wram(const gb* g);
+GB_API const uint8_t* gb_hram(const gb* g);
+
+GB_API size_t gb_state_bound(gb* g);
+GB_API size_t gb_save_state(gb* g, uint8_t* buf, size_t cap, int flags);
+GB_API int gb_load_state(gb* g, const uint8_t* buf, size_t len);
+GB_API int gb_save_state_file(gb* g, const char* path);
+GB_API int gb_load_state_file(gb* g, const char* path);
+// a hash of everything a save state holds, the same on every host
+GB_API uint64_t gb_state_hash(gb* g);
+
+// rewind: the machine's recent past in a fixed budget of memory, as a
+// keyframe every `keyframe` frames and small deltas in between. capture once
+// per frame, each step goes back one captured frame. gb_rewind_new()
+// returns NULL when the budget is too small to be useful
+typedef struct gb_rewind gb_rewind;
+
+GB_API gb_rewind* gb_rewind_new(gb* g, size_t budget, int keyframe);
+GB_API void gb_rewind_free(gb_rewind* r);
+GB_API void gb_rewind_capture(gb_rewind* r);
+GB_API int gb_rewind_step(gb_rewind* r);
+GB_API uint32_t gb_rewind_frames(gb_rewind* r);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,142 @@
+# ctypes binding for libsmallboy.so (make libsmallboy.so), see smallboy.h.
+#
+#   gb = smallboy.GameBoy('rom.gb')
+#   while gb.run_frame() is None:
+#       gb.set_input(policy(gb.screen))
+#
+# screen, wram and hram are views of the machine's own memory, not copies:
+# they are created once and show the new contents after every run_frame().
+# with numpy they are read-only arrays, without it read-only memoryviews.
+# they point into the machine, so don't touch them after close()
+import ctypes
+import os
+
+try:
+    import numpy
+except ImportError:
+    numpy = None
+
+WIDTH, HEIGHT = 160, 144
+WRAM_SIZE, HRAM_SIZE = 0x2000, 0x100
+
+# set_input() keys
+RIGHT, LEFT, UP, DOWN, A, B, SELECT, START = (1 << i for i in range(8))
+
+JIT_OFF, JIT_ON, JIT_DIFF = range(3)
+
+STATE_RLE = 0x01
+
+_lib = None
+
+
+def library(path=None):
+    """loads libsmallboy.so once, from path, $SMALLBOY_LIB or next to this
+    file"""
+    global _lib
+    if _lib:
+        return _lib
+    path = path or os.environ.get('SMALLBOY_LIB') or os.path.join(
+        os.path.dirname(os.path.abspath(__file__)), 'libsmallboy.so')
+    lib = ctypes.CDLL(path)
+    p, u8p = ctypes.c_void_p, ctypes.POINTER(ctypes.c_uint8)
+    sigs = {
+        'gb_create': (p, [ctypes.c_char_p, ctypes.c_int,
+                          ctypes.POINTER(ctypes.c_int)]),
+        'gb_destroy': (None, [p]),
+        'gb_run': (ctypes.c_int, [p, ctypes.c_uint64]),
+        'gb_run_frame': (ctypes.c_int, [p]),
+        'run_status_name': (ctypes.c_char_p, [ctypes.c_int]),
+        'gb_set_input': (None, [p, ctypes.c_uint8]),
+        'gb_set_render': (None, [p, ctypes.c_int]),
+        'gb_framebuffer': (p, [p]),
+        'gb_wram': (p, [p]),
+        'gb_hram': (p, [p]),
+        'gb_state_bound': (ctypes.c_size_t, [p]),
+        'gb_save_state': (ctypes.c_size_t,
+                          [p, u8p, ctypes.c_size_t, ctypes.c_int]),
+        'gb_load_state': (ctypes.c_int, [p, u8p, ctypes.c_size_t]),
+        'gb_state_hash': (ctypes.c_uint64, [p]),
+    }
+    for name, (res, args) in sigs.items():
+        f = getattr(lib, name)
+        f.restype, f.argtypes = res, args
+    _lib = lib
+    return lib
+
+
+def status_name(status):
+    return library().run_status_name(status).decode()
+
+
+def _view(addr, shape):
+    n = 1
+    for d in shape:
+        n *= d
+    buf = (ctypes.c_uint8 * n).from_address(addr)
+    if numpy is not None:
+        a = numpy.frombuffer(buf, dtype=numpy.uint8).reshape(shape)
+        a.flags.writeable = False
+        return a
+    return memoryview(buf).cast('B', shape).toreadonly()
+
+
+class GameBoy:
+    def __init__(self, rom, jit=JIT_OFF, lib=None):
+        self._lib = library(lib)
+        err = ctypes.c_int()
+        self._g = self._lib.gb_create(os.fsencode(rom), jit,
+                                      ctypes.byref(err))
+        if not self._g:
+            raise OSError('failed to load rom %s (%d)' % (rom, err.value))
+        self.screen = _view(self._lib.gb_framebuffer(self._g),
+                            (HEIGHT, WIDTH))
+        self.wram = _view(self._lib.gb_wram(self._g), (WRAM_SIZE,))
+        self.hram = _view(self._lib.gb_hram(self._g), (HRAM_SIZE,))
+
+    def run_frame(self):
+        """runs to the end of the next frame. None while the rom runs on,
+        its RUN_* status once it has stopped"""
+        status = self._lib.gb_run_frame(self._g)
+        return None if status < 0 else status
+
+    def run(self, cycles):
+        return self._lib.gb_run(self._g, cycles)
+
+    def set_input(self, buttons):
+        """buttons is a mask of RIGHT, LEFT, ... held down"""
+        self._lib.gb_set_input(self._g, buttons)
+
+    def set_render(self, on):
+        self._lib.gb_set_render(self._g, int(on))
+
+    def save_state(self, flags=STATE_RLE):
+        buf = (ctypes.c_uint8 * self._lib.gb_state_bound(self._g))()
+        n = self._lib.gb_save_state(self._g, buf, len(buf), flags)
+        if not n:
+            raise OSError('failed to save state')
+        return bytes(buf[:n])
+
+    def load_state(self, state):
+        buf = (ctypes.c_uint8 * len(state)).from_buffer_copy(state)
+        err = self._lib.gb_load_state(self._g, buf, len(state))
+        if err:
+            raise ValueError('failed to load state (%d)' % err)
+
+    def state_hash(self):
+        """64-bit hash of everything a save state holds"""
+        return self._lib.gb_state_hash(self._g)
+
+    def close(self):
+        if self._g:
+            self._lib.gb_destroy(self._g)
+            self._g = None
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *exc):
+        self.close()
+
+    def __del__(self):
+        if getattr(self, '_g', None):
+            self.close()
@@ -0,0 +1,81 @@
+// lock-free hand-offs between the emulation thread and the presenter, each
+// with exactly one writer and one reader
+#include "typedefs.h"
+#include <stdatomic.h>
+
+// triple buffer: the writer fills its back slot and swaps it with the shared
+// one, the reader swaps its front slot with the shared one when that holds a
+// newer frame. neither side ever waits, the reader just sees the latest
+// frame and anything published in between is dropped
+#define TB_FRESH 4 // the shared slot was published since the reader took one
+
+typedef struct {
+    _Atomic u8 shared; // slot index | TB_FRESH
+    u8 back;           // writer's slot
+    u8 front;          // reader's slot
+} triple;
+
+static inline void triple_init(triple* t) {
+    atomic_init(&t->shared, 1);
+    t->back = 0;
+    t->front = 2;
+}
+
+// publishes the back slot, returns the index of the new one to fill
+static inline int triple_publish(triple* t) {
+    t->back = atomic_exchange_explicit(&t->shared, t->back | TB_FRESH,
+                                       memory_order_acq_rel) & 3;
+    return t->back;
+}
+
+// index of the newest published slot, or -1 if nothing new came in
+static inline int triple_take(triple* t) {
+    if (!(atomic_load_explicit(&t->shared, memory_order_relaxed) & TB_FRESH))
+        return -1;
+    t->front = atomic_exchange_explicit(&t->shared, t->front,
+                                        memory_order_acq_rel) & 3;
+    return t->front;
+}
+
+// single producer, single consumer ring of fixed size messages. head is only
+// written by the producer and tail by the consumer
+#define SPSC_SIZE 64 // power of two
+
+// a message, what kind means is up to the two ends
+typedef struct {
+    u8 kind;
+    u8 arg;
+    u16 addr;
+} msg;
+
+typedef struct {
+    msg msgs[SPSC_SIZE];
+    _Atomic u32 head;
+    _Atomic u32 tail;
+} spsc;
+
+static inline void spsc_init(spsc* q) {
+    atomic_init(&q->head, 0);
+    atomic_init(&q->tail, 0);
+}
+
+// 0 if the queue is full
+static inline int spsc_push(spsc* q, msg m) {
+    u32 head = atomic_load_explicit(&q->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&q->tail, memory_order_acquire) ==
+        SPSC_SIZE)
+        return 0;
+    q->msgs[head % SPSC_SIZE] = m;
+    atomic_store_explicit(&q->head, head + 1, memory_order_release);
+    return 1;
+}
+
+// 0 if the queue is empty
+static inline int spsc_pop(spsc* q, msg* m) {
+    u32 tail = atomic_load_explicit(&q->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&q->head, memory_order_acquire))
+        return 0;
+    *m = q->msgs[tail % SPSC_SIZE];
+    atomic_store_explicit(&q->tail, tail + 1, memory_order_release);
+    return 1;
+}